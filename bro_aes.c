@@ -22,7 +22,26 @@
 #include "bro_aes.h"
 
 
-#define RCON(x)                            (rcon(x) << 24)
+#define RCON(x)                            (aes_rcon[x] << 24)
+
+#if AES_TD_TABLES == 4
+#define TD0(x)                             aes_td[0][x]
+#define TD1(x)                             aes_td[1][x]
+#define TD2(x)                             aes_td[2][x]
+#define TD3(x)                             aes_td[3][x]
+#elif AES_TD_TABLES == 1
+#define TD0(x)                             aes_td[0][x]
+#define TD1(x)                             ROTATE(aes_td[0][x], 24)
+#define TD2(x)                             ROTATE(aes_td[0][x], 16)
+#define TD3(x)                             ROTATE(aes_td[0][x],  8)
+#endif
+
+/* Shared by every key, either read-only in flash or copied to SRAM at startup */
+#if AES_IN_RAM >= 1
+#define AES_TABLE                          __attribute__((section(".data.aes_tables")))
+#else
+#define AES_TABLE                          const
+#endif
 
 #if STANDARD_AS_OPENSSL == 1
 #define SWAP(x)                            __builtin_bswap32(x)
@@ -31,44 +50,198 @@
 #endif
 
 
-static uint8_t rcon(uint8_t i) {
-    uint8_t c;
-
-    for (c = 1; i != 1; i--)
-        c = c << 1 ^ (c & 0x80 ? 0x1b : 0);
-
-    return c;
-}
-
 // https://en.wikipedia.org/wiki/Rijndael_S-box
-static void initialize_aes_sbox(uint8_t *sbox)
-{
-    /* loop invariant: p * q == 1 in the Galois field */
-    uint8_t p = 1, q = 1;
-    do {
-        /* multiply p by x+1 */
-        p = p ^ (p << 1) ^ (p & 0x80 ? 0x1B : 0);
-        /* divide q by x+1 */
-        q ^= q << 1;
-        q ^= q << 2;
-        q ^= q << 4;
-        q ^= q & 0x80 ? 0x09 : 0;
-        /* compute the affine transformation */
-        sbox[p] = 0x63 ^ q ^ ROTL8(q, 1) ^ ROTL8(q, 2) ^ ROTL8(q, 3) ^ ROTL8(q, 4);
-    } while (p != 1);
-    /* 0 is a special case since it has no inverse */
-    sbox[0] = 0x63;
-}
-
-static void initialize_aes_inv_sbox(uint8_t *inv_sbox)
-{
-    uint8_t sbox[256];
-    int32_t i;
+static AES_TABLE uint8_t aes_sbox[256] = {
+    0x63, 0x7c, 0x77, 0x7b, 0xf2, 0x6b, 0x6f, 0xc5, 0x30, 0x01, 0x67, 0x2b, 0xfe, 0xd7, 0xab, 0x76,
+    0xca, 0x82, 0xc9, 0x7d, 0xfa, 0x59, 0x47, 0xf0, 0xad, 0xd4, 0xa2, 0xaf, 0x9c, 0xa4, 0x72, 0xc0,
+    0xb7, 0xfd, 0x93, 0x26, 0x36, 0x3f, 0xf7, 0xcc, 0x34, 0xa5, 0xe5, 0xf1, 0x71, 0xd8, 0x31, 0x15,
+    0x04, 0xc7, 0x23, 0xc3, 0x18, 0x96, 0x05, 0x9a, 0x07, 0x12, 0x80, 0xe2, 0xeb, 0x27, 0xb2, 0x75,
+    0x09, 0x83, 0x2c, 0x1a, 0x1b, 0x6e, 0x5a, 0xa0, 0x52, 0x3b, 0xd6, 0xb3, 0x29, 0xe3, 0x2f, 0x84,
+    0x53, 0xd1, 0x00, 0xed, 0x20, 0xfc, 0xb1, 0x5b, 0x6a, 0xcb, 0xbe, 0x39, 0x4a, 0x4c, 0x58, 0xcf,
+    0xd0, 0xef, 0xaa, 0xfb, 0x43, 0x4d, 0x33, 0x85, 0x45, 0xf9, 0x02, 0x7f, 0x50, 0x3c, 0x9f, 0xa8,
+    0x51, 0xa3, 0x40, 0x8f, 0x92, 0x9d, 0x38, 0xf5, 0xbc, 0xb6, 0xda, 0x21, 0x10, 0xff, 0xf3, 0xd2,
+    0xcd, 0x0c, 0x13, 0xec, 0x5f, 0x97, 0x44, 0x17, 0xc4, 0xa7, 0x7e, 0x3d, 0x64, 0x5d, 0x19, 0x73,
+    0x60, 0x81, 0x4f, 0xdc, 0x22, 0x2a, 0x90, 0x88, 0x46, 0xee, 0xb8, 0x14, 0xde, 0x5e, 0x0b, 0xdb,
+    0xe0, 0x32, 0x3a, 0x0a, 0x49, 0x06, 0x24, 0x5c, 0xc2, 0xd3, 0xac, 0x62, 0x91, 0x95, 0xe4, 0x79,
+    0xe7, 0xc8, 0x37, 0x6d, 0x8d, 0xd5, 0x4e, 0xa9, 0x6c, 0x56, 0xf4, 0xea, 0x65, 0x7a, 0xae, 0x08,
+    0xba, 0x78, 0x25, 0x2e, 0x1c, 0xa6, 0xb4, 0xc6, 0xe8, 0xdd, 0x74, 0x1f, 0x4b, 0xbd, 0x8b, 0x8a,
+    0x70, 0x3e, 0xb5, 0x66, 0x48, 0x03, 0xf6, 0x0e, 0x61, 0x35, 0x57, 0xb9, 0x86, 0xc1, 0x1d, 0x9e,
+    0xe1, 0xf8, 0x98, 0x11, 0x69, 0xd9, 0x8e, 0x94, 0x9b, 0x1e, 0x87, 0xe9, 0xce, 0x55, 0x28, 0xdf,
+    0x8c, 0xa1, 0x89, 0x0d, 0xbf, 0xe6, 0x42, 0x68, 0x41, 0x99, 0x2d, 0x0f, 0xb0, 0x54, 0xbb, 0x16,
+};
+
+static AES_TABLE uint8_t aes_inv_sbox[256] = {
+    0x52, 0x09, 0x6a, 0xd5, 0x30, 0x36, 0xa5, 0x38, 0xbf, 0x40, 0xa3, 0x9e, 0x81, 0xf3, 0xd7, 0xfb,
+    0x7c, 0xe3, 0x39, 0x82, 0x9b, 0x2f, 0xff, 0x87, 0x34, 0x8e, 0x43, 0x44, 0xc4, 0xde, 0xe9, 0xcb,
+    0x54, 0x7b, 0x94, 0x32, 0xa6, 0xc2, 0x23, 0x3d, 0xee, 0x4c, 0x95, 0x0b, 0x42, 0xfa, 0xc3, 0x4e,
+    0x08, 0x2e, 0xa1, 0x66, 0x28, 0xd9, 0x24, 0xb2, 0x76, 0x5b, 0xa2, 0x49, 0x6d, 0x8b, 0xd1, 0x25,
+    0x72, 0xf8, 0xf6, 0x64, 0x86, 0x68, 0x98, 0x16, 0xd4, 0xa4, 0x5c, 0xcc, 0x5d, 0x65, 0xb6, 0x92,
+    0x6c, 0x70, 0x48, 0x50, 0xfd, 0xed, 0xb9, 0xda, 0x5e, 0x15, 0x46, 0x57, 0xa7, 0x8d, 0x9d, 0x84,
+    0x90, 0xd8, 0xab, 0x00, 0x8c, 0xbc, 0xd3, 0x0a, 0xf7, 0xe4, 0x58, 0x05, 0xb8, 0xb3, 0x45, 0x06,
+    0xd0, 0x2c, 0x1e, 0x8f, 0xca, 0x3f, 0x0f, 0x02, 0xc1, 0xaf, 0xbd, 0x03, 0x01, 0x13, 0x8a, 0x6b,
+    0x3a, 0x91, 0x11, 0x41, 0x4f, 0x67, 0xdc, 0xea, 0x97, 0xf2, 0xcf, 0xce, 0xf0, 0xb4, 0xe6, 0x73,
+    0x96, 0xac, 0x74, 0x22, 0xe7, 0xad, 0x35, 0x85, 0xe2, 0xf9, 0x37, 0xe8, 0x1c, 0x75, 0xdf, 0x6e,
+    0x47, 0xf1, 0x1a, 0x71, 0x1d, 0x29, 0xc5, 0x89, 0x6f, 0xb7, 0x62, 0x0e, 0xaa, 0x18, 0xbe, 0x1b,
+    0xfc, 0x56, 0x3e, 0x4b, 0xc6, 0xd2, 0x79, 0x20, 0x9a, 0xdb, 0xc0, 0xfe, 0x78, 0xcd, 0x5a, 0xf4,
+    0x1f, 0xdd, 0xa8, 0x33, 0x88, 0x07, 0xc7, 0x31, 0xb1, 0x12, 0x10, 0x59, 0x27, 0x80, 0xec, 0x5f,
+    0x60, 0x51, 0x7f, 0xa9, 0x19, 0xb5, 0x4a, 0x0d, 0x2d, 0xe5, 0x7a, 0x9f, 0x93, 0xc9, 0x9c, 0xef,
+    0xa0, 0xe0, 0x3b, 0x4d, 0xae, 0x2a, 0xf5, 0xb0, 0xc8, 0xeb, 0xbb, 0x3c, 0x83, 0x53, 0x99, 0x61,
+    0x17, 0x2b, 0x04, 0x7e, 0xba, 0x77, 0xd6, 0x26, 0xe1, 0x69, 0x14, 0x63, 0x55, 0x21, 0x0c, 0x7d,
+};
+
+#if AES_TD_TABLES >= 1
+/* InvSubBytes and InvMixColumns folded together, Td[n][x] is the column a
+ * byte x at bit 24 - 8 * n contributes; Td[1..3] are Td[0] rotated */
+static AES_TABLE uint32_t aes_td[AES_TD_TABLES][256] = {
+    {
+        0x51f4a750, 0x7e416553, 0x1a17a4c3, 0x3a275e96, 0x3bab6bcb, 0x1f9d45f1, 0xacfa58ab, 0x4be30393,
+        0x2030fa55, 0xad766df6, 0x88cc7691, 0xf5024c25, 0x4fe5d7fc, 0xc52acbd7, 0x26354480, 0xb562a38f,
+        0xdeb15a49, 0x25ba1b67, 0x45ea0e98, 0x5dfec0e1, 0xc32f7502, 0x814cf012, 0x8d4697a3, 0x6bd3f9c6,
+        0x038f5fe7, 0x15929c95, 0xbf6d7aeb, 0x955259da, 0xd4be832d, 0x587421d3, 0x49e06929, 0x8ec9c844,
+        0x75c2896a, 0xf48e7978, 0x99583e6b, 0x27b971dd, 0xbee14fb6, 0xf088ad17, 0xc920ac66, 0x7dce3ab4,
+        0x63df4a18, 0xe51a3182, 0x97513360, 0x62537f45, 0xb16477e0, 0xbb6bae84, 0xfe81a01c, 0xf9082b94,
+        0x70486858, 0x8f45fd19, 0x94de6c87, 0x527bf8b7, 0xab73d323, 0x724b02e2, 0xe31f8f57, 0x6655ab2a,
+        0xb2eb2807, 0x2fb5c203, 0x86c57b9a, 0xd33708a5, 0x302887f2, 0x23bfa5b2, 0x02036aba, 0xed16825c,
+        0x8acf1c2b, 0xa779b492, 0xf307f2f0, 0x4e69e2a1, 0x65daf4cd, 0x0605bed5, 0xd134621f, 0xc4a6fe8a,
+        0x342e539d, 0xa2f355a0, 0x058ae132, 0xa4f6eb75, 0x0b83ec39, 0x4060efaa, 0x5e719f06, 0xbd6e1051,
+        0x3e218af9, 0x96dd063d, 0xdd3e05ae, 0x4de6bd46, 0x91548db5, 0x71c45d05, 0x0406d46f, 0x605015ff,
+        0x1998fb24, 0xd6bde997, 0x894043cc, 0x67d99e77, 0xb0e842bd, 0x07898b88, 0xe7195b38, 0x79c8eedb,
+        0xa17c0a47, 0x7c420fe9, 0xf8841ec9, 0x00000000, 0x09808683, 0x322bed48, 0x1e1170ac, 0x6c5a724e,
+        0xfd0efffb, 0x0f853856, 0x3daed51e, 0x362d3927, 0x0a0fd964, 0x685ca621, 0x9b5b54d1, 0x24362e3a,
+        0x0c0a67b1, 0x9357e70f, 0xb4ee96d2, 0x1b9b919e, 0x80c0c54f, 0x61dc20a2, 0x5a774b69, 0x1c121a16,
+        0xe293ba0a, 0xc0a02ae5, 0x3c22e043, 0x121b171d, 0x0e090d0b, 0xf28bc7ad, 0x2db6a8b9, 0x141ea9c8,
+        0x57f11985, 0xaf75074c, 0xee99ddbb, 0xa37f60fd, 0xf701269f, 0x5c72f5bc, 0x44663bc5, 0x5bfb7e34,
+        0x8b432976, 0xcb23c6dc, 0xb6edfc68, 0xb8e4f163, 0xd731dcca, 0x42638510, 0x13972240, 0x84c61120,
+        0x854a247d, 0xd2bb3df8, 0xaef93211, 0xc729a16d, 0x1d9e2f4b, 0xdcb230f3, 0x0d8652ec, 0x77c1e3d0,
+        0x2bb3166c, 0xa970b999, 0x119448fa, 0x47e96422, 0xa8fc8cc4, 0xa0f03f1a, 0x567d2cd8, 0x223390ef,
+        0x87494ec7, 0xd938d1c1, 0x8ccaa2fe, 0x98d40b36, 0xa6f581cf, 0xa57ade28, 0xdab78e26, 0x3fadbfa4,
+        0x2c3a9de4, 0x5078920d, 0x6a5fcc9b, 0x547e4662, 0xf68d13c2, 0x90d8b8e8, 0x2e39f75e, 0x82c3aff5,
+        0x9f5d80be, 0x69d0937c, 0x6fd52da9, 0xcf2512b3, 0xc8ac993b, 0x10187da7, 0xe89c636e, 0xdb3bbb7b,
+        0xcd267809, 0x6e5918f4, 0xec9ab701, 0x834f9aa8, 0xe6956e65, 0xaaffe67e, 0x21bccf08, 0xef15e8e6,
+        0xbae79bd9, 0x4a6f36ce, 0xea9f09d4, 0x29b07cd6, 0x31a4b2af, 0x2a3f2331, 0xc6a59430, 0x35a266c0,
+        0x744ebc37, 0xfc82caa6, 0xe090d0b0, 0x33a7d815, 0xf104984a, 0x41ecdaf7, 0x7fcd500e, 0x1791f62f,
+        0x764dd68d, 0x43efb04d, 0xccaa4d54, 0xe49604df, 0x9ed1b5e3, 0x4c6a881b, 0xc12c1fb8, 0x4665517f,
+        0x9d5eea04, 0x018c355d, 0xfa877473, 0xfb0b412e, 0xb3671d5a, 0x92dbd252, 0xe9105633, 0x6dd64713,
+        0x9ad7618c, 0x37a10c7a, 0x59f8148e, 0xeb133c89, 0xcea927ee, 0xb761c935, 0xe11ce5ed, 0x7a47b13c,
+        0x9cd2df59, 0x55f2733f, 0x1814ce79, 0x73c737bf, 0x53f7cdea, 0x5ffdaa5b, 0xdf3d6f14, 0x7844db86,
+        0xcaaff381, 0xb968c43e, 0x3824342c, 0xc2a3405f, 0x161dc372, 0xbce2250c, 0x283c498b, 0xff0d9541,
+        0x39a80171, 0x080cb3de, 0xd8b4e49c, 0x6456c190, 0x7bcb8461, 0xd532b670, 0x486c5c74, 0xd0b85742,
+    },
+#if AES_TD_TABLES == 4
+    {
+        0x5051f4a7, 0x537e4165, 0xc31a17a4, 0x963a275e, 0xcb3bab6b, 0xf11f9d45, 0xabacfa58, 0x934be303,
+        0x552030fa, 0xf6ad766d, 0x9188cc76, 0x25f5024c, 0xfc4fe5d7, 0xd7c52acb, 0x80263544, 0x8fb562a3,
+        0x49deb15a, 0x6725ba1b, 0x9845ea0e, 0xe15dfec0, 0x02c32f75, 0x12814cf0, 0xa38d4697, 0xc66bd3f9,
+        0xe7038f5f, 0x9515929c, 0xebbf6d7a, 0xda955259, 0x2dd4be83, 0xd3587421, 0x2949e069, 0x448ec9c8,
+        0x6a75c289, 0x78f48e79, 0x6b99583e, 0xdd27b971, 0xb6bee14f, 0x17f088ad, 0x66c920ac, 0xb47dce3a,
+        0x1863df4a, 0x82e51a31, 0x60975133, 0x4562537f, 0xe0b16477, 0x84bb6bae, 0x1cfe81a0, 0x94f9082b,
+        0x58704868, 0x198f45fd, 0x8794de6c, 0xb7527bf8, 0x23ab73d3, 0xe2724b02, 0x57e31f8f, 0x2a6655ab,
+        0x07b2eb28, 0x032fb5c2, 0x9a86c57b, 0xa5d33708, 0xf2302887, 0xb223bfa5, 0xba02036a, 0x5ced1682,
+        0x2b8acf1c, 0x92a779b4, 0xf0f307f2, 0xa14e69e2, 0xcd65daf4, 0xd50605be, 0x1fd13462, 0x8ac4a6fe,
+        0x9d342e53, 0xa0a2f355, 0x32058ae1, 0x75a4f6eb, 0x390b83ec, 0xaa4060ef, 0x065e719f, 0x51bd6e10,
+        0xf93e218a, 0x3d96dd06, 0xaedd3e05, 0x464de6bd, 0xb591548d, 0x0571c45d, 0x6f0406d4, 0xff605015,
+        0x241998fb, 0x97d6bde9, 0xcc894043, 0x7767d99e, 0xbdb0e842, 0x8807898b, 0x38e7195b, 0xdb79c8ee,
+        0x47a17c0a, 0xe97c420f, 0xc9f8841e, 0x00000000, 0x83098086, 0x48322bed, 0xac1e1170, 0x4e6c5a72,
+        0xfbfd0eff, 0x560f8538, 0x1e3daed5, 0x27362d39, 0x640a0fd9, 0x21685ca6, 0xd19b5b54, 0x3a24362e,
+        0xb10c0a67, 0x0f9357e7, 0xd2b4ee96, 0x9e1b9b91, 0x4f80c0c5, 0xa261dc20, 0x695a774b, 0x161c121a,
+        0x0ae293ba, 0xe5c0a02a, 0x433c22e0, 0x1d121b17, 0x0b0e090d, 0xadf28bc7, 0xb92db6a8, 0xc8141ea9,
+        0x8557f119, 0x4caf7507, 0xbbee99dd, 0xfda37f60, 0x9ff70126, 0xbc5c72f5, 0xc544663b, 0x345bfb7e,
+        0x768b4329, 0xdccb23c6, 0x68b6edfc, 0x63b8e4f1, 0xcad731dc, 0x10426385, 0x40139722, 0x2084c611,
+        0x7d854a24, 0xf8d2bb3d, 0x11aef932, 0x6dc729a1, 0x4b1d9e2f, 0xf3dcb230, 0xec0d8652, 0xd077c1e3,
+        0x6c2bb316, 0x99a970b9, 0xfa119448, 0x2247e964, 0xc4a8fc8c, 0x1aa0f03f, 0xd8567d2c, 0xef223390,
+        0xc787494e, 0xc1d938d1, 0xfe8ccaa2, 0x3698d40b, 0xcfa6f581, 0x28a57ade, 0x26dab78e, 0xa43fadbf,
+        0xe42c3a9d, 0x0d507892, 0x9b6a5fcc, 0x62547e46, 0xc2f68d13, 0xe890d8b8, 0x5e2e39f7, 0xf582c3af,
+        0xbe9f5d80, 0x7c69d093, 0xa96fd52d, 0xb3cf2512, 0x3bc8ac99, 0xa710187d, 0x6ee89c63, 0x7bdb3bbb,
+        0x09cd2678, 0xf46e5918, 0x01ec9ab7, 0xa8834f9a, 0x65e6956e, 0x7eaaffe6, 0x0821bccf, 0xe6ef15e8,
+        0xd9bae79b, 0xce4a6f36, 0xd4ea9f09, 0xd629b07c, 0xaf31a4b2, 0x312a3f23, 0x30c6a594, 0xc035a266,
+        0x37744ebc, 0xa6fc82ca, 0xb0e090d0, 0x1533a7d8, 0x4af10498, 0xf741ecda, 0x0e7fcd50, 0x2f1791f6,
+        0x8d764dd6, 0x4d43efb0, 0x54ccaa4d, 0xdfe49604, 0xe39ed1b5, 0x1b4c6a88, 0xb8c12c1f, 0x7f466551,
+        0x049d5eea, 0x5d018c35, 0x73fa8774, 0x2efb0b41, 0x5ab3671d, 0x5292dbd2, 0x33e91056, 0x136dd647,
+        0x8c9ad761, 0x7a37a10c, 0x8e59f814, 0x89eb133c, 0xeecea927, 0x35b761c9, 0xede11ce5, 0x3c7a47b1,
+        0x599cd2df, 0x3f55f273, 0x791814ce, 0xbf73c737, 0xea53f7cd, 0x5b5ffdaa, 0x14df3d6f, 0x867844db,
+        0x81caaff3, 0x3eb968c4, 0x2c382434, 0x5fc2a340, 0x72161dc3, 0x0cbce225, 0x8b283c49, 0x41ff0d95,
+        0x7139a801, 0xde080cb3, 0x9cd8b4e4, 0x906456c1, 0x617bcb84, 0x70d532b6, 0x74486c5c, 0x42d0b857,
+    },
+    {
+        0xa75051f4, 0x65537e41, 0xa4c31a17, 0x5e963a27, 0x6bcb3bab, 0x45f11f9d, 0x58abacfa, 0x03934be3,
+        0xfa552030, 0x6df6ad76, 0x769188cc, 0x4c25f502, 0xd7fc4fe5, 0xcbd7c52a, 0x44802635, 0xa38fb562,
+        0x5a49deb1, 0x1b6725ba, 0x0e9845ea, 0xc0e15dfe, 0x7502c32f, 0xf012814c, 0x97a38d46, 0xf9c66bd3,
+        0x5fe7038f, 0x9c951592, 0x7aebbf6d, 0x59da9552, 0x832dd4be, 0x21d35874, 0x692949e0, 0xc8448ec9,
+        0x896a75c2, 0x7978f48e, 0x3e6b9958, 0x71dd27b9, 0x4fb6bee1, 0xad17f088, 0xac66c920, 0x3ab47dce,
+        0x4a1863df, 0x3182e51a, 0x33609751, 0x7f456253, 0x77e0b164, 0xae84bb6b, 0xa01cfe81, 0x2b94f908,
+        0x68587048, 0xfd198f45, 0x6c8794de, 0xf8b7527b, 0xd323ab73, 0x02e2724b, 0x8f57e31f, 0xab2a6655,
+        0x2807b2eb, 0xc2032fb5, 0x7b9a86c5, 0x08a5d337, 0x87f23028, 0xa5b223bf, 0x6aba0203, 0x825ced16,
+        0x1c2b8acf, 0xb492a779, 0xf2f0f307, 0xe2a14e69, 0xf4cd65da, 0xbed50605, 0x621fd134, 0xfe8ac4a6,
+        0x539d342e, 0x55a0a2f3, 0xe132058a, 0xeb75a4f6, 0xec390b83, 0xefaa4060, 0x9f065e71, 0x1051bd6e,
+        0x8af93e21, 0x063d96dd, 0x05aedd3e, 0xbd464de6, 0x8db59154, 0x5d0571c4, 0xd46f0406, 0x15ff6050,
+        0xfb241998, 0xe997d6bd, 0x43cc8940, 0x9e7767d9, 0x42bdb0e8, 0x8b880789, 0x5b38e719, 0xeedb79c8,
+        0x0a47a17c, 0x0fe97c42, 0x1ec9f884, 0x00000000, 0x86830980, 0xed48322b, 0x70ac1e11, 0x724e6c5a,
+        0xfffbfd0e, 0x38560f85, 0xd51e3dae, 0x3927362d, 0xd9640a0f, 0xa621685c, 0x54d19b5b, 0x2e3a2436,
+        0x67b10c0a, 0xe70f9357, 0x96d2b4ee, 0x919e1b9b, 0xc54f80c0, 0x20a261dc, 0x4b695a77, 0x1a161c12,
+        0xba0ae293, 0x2ae5c0a0, 0xe0433c22, 0x171d121b, 0x0d0b0e09, 0xc7adf28b, 0xa8b92db6, 0xa9c8141e,
+        0x198557f1, 0x074caf75, 0xddbbee99, 0x60fda37f, 0x269ff701, 0xf5bc5c72, 0x3bc54466, 0x7e345bfb,
+        0x29768b43, 0xc6dccb23, 0xfc68b6ed, 0xf163b8e4, 0xdccad731, 0x85104263, 0x22401397, 0x112084c6,
+        0x247d854a, 0x3df8d2bb, 0x3211aef9, 0xa16dc729, 0x2f4b1d9e, 0x30f3dcb2, 0x52ec0d86, 0xe3d077c1,
+        0x166c2bb3, 0xb999a970, 0x48fa1194, 0x642247e9, 0x8cc4a8fc, 0x3f1aa0f0, 0x2cd8567d, 0x90ef2233,
+        0x4ec78749, 0xd1c1d938, 0xa2fe8cca, 0x0b3698d4, 0x81cfa6f5, 0xde28a57a, 0x8e26dab7, 0xbfa43fad,
+        0x9de42c3a, 0x920d5078, 0xcc9b6a5f, 0x4662547e, 0x13c2f68d, 0xb8e890d8, 0xf75e2e39, 0xaff582c3,
+        0x80be9f5d, 0x937c69d0, 0x2da96fd5, 0x12b3cf25, 0x993bc8ac, 0x7da71018, 0x636ee89c, 0xbb7bdb3b,
+        0x7809cd26, 0x18f46e59, 0xb701ec9a, 0x9aa8834f, 0x6e65e695, 0xe67eaaff, 0xcf0821bc, 0xe8e6ef15,
+        0x9bd9bae7, 0x36ce4a6f, 0x09d4ea9f, 0x7cd629b0, 0xb2af31a4, 0x23312a3f, 0x9430c6a5, 0x66c035a2,
+        0xbc37744e, 0xcaa6fc82, 0xd0b0e090, 0xd81533a7, 0x984af104, 0xdaf741ec, 0x500e7fcd, 0xf62f1791,
+        0xd68d764d, 0xb04d43ef, 0x4d54ccaa, 0x04dfe496, 0xb5e39ed1, 0x881b4c6a, 0x1fb8c12c, 0x517f4665,
+        0xea049d5e, 0x355d018c, 0x7473fa87, 0x412efb0b, 0x1d5ab367, 0xd25292db, 0x5633e910, 0x47136dd6,
+        0x618c9ad7, 0x0c7a37a1, 0x148e59f8, 0x3c89eb13, 0x27eecea9, 0xc935b761, 0xe5ede11c, 0xb13c7a47,
+        0xdf599cd2, 0x733f55f2, 0xce791814, 0x37bf73c7, 0xcdea53f7, 0xaa5b5ffd, 0x6f14df3d, 0xdb867844,
+        0xf381caaf, 0xc43eb968, 0x342c3824, 0x405fc2a3, 0xc372161d, 0x250cbce2, 0x498b283c, 0x9541ff0d,
+        0x017139a8, 0xb3de080c, 0xe49cd8b4, 0xc1906456, 0x84617bcb, 0xb670d532, 0x5c74486c, 0x5742d0b8,
+    },
+    {
+        0xf4a75051, 0x4165537e, 0x17a4c31a, 0x275e963a, 0xab6bcb3b, 0x9d45f11f, 0xfa58abac, 0xe303934b,
+        0x30fa5520, 0x766df6ad, 0xcc769188, 0x024c25f5, 0xe5d7fc4f, 0x2acbd7c5, 0x35448026, 0x62a38fb5,
+        0xb15a49de, 0xba1b6725, 0xea0e9845, 0xfec0e15d, 0x2f7502c3, 0x4cf01281, 0x4697a38d, 0xd3f9c66b,
+        0x8f5fe703, 0x929c9515, 0x6d7aebbf, 0x5259da95, 0xbe832dd4, 0x7421d358, 0xe0692949, 0xc9c8448e,
+        0xc2896a75, 0x8e7978f4, 0x583e6b99, 0xb971dd27, 0xe14fb6be, 0x88ad17f0, 0x20ac66c9, 0xce3ab47d,
+        0xdf4a1863, 0x1a3182e5, 0x51336097, 0x537f4562, 0x6477e0b1, 0x6bae84bb, 0x81a01cfe, 0x082b94f9,
+        0x48685870, 0x45fd198f, 0xde6c8794, 0x7bf8b752, 0x73d323ab, 0x4b02e272, 0x1f8f57e3, 0x55ab2a66,
+        0xeb2807b2, 0xb5c2032f, 0xc57b9a86, 0x3708a5d3, 0x2887f230, 0xbfa5b223, 0x036aba02, 0x16825ced,
+        0xcf1c2b8a, 0x79b492a7, 0x07f2f0f3, 0x69e2a14e, 0xdaf4cd65, 0x05bed506, 0x34621fd1, 0xa6fe8ac4,
+        0x2e539d34, 0xf355a0a2, 0x8ae13205, 0xf6eb75a4, 0x83ec390b, 0x60efaa40, 0x719f065e, 0x6e1051bd,
+        0x218af93e, 0xdd063d96, 0x3e05aedd, 0xe6bd464d, 0x548db591, 0xc45d0571, 0x06d46f04, 0x5015ff60,
+        0x98fb2419, 0xbde997d6, 0x4043cc89, 0xd99e7767, 0xe842bdb0, 0x898b8807, 0x195b38e7, 0xc8eedb79,
+        0x7c0a47a1, 0x420fe97c, 0x841ec9f8, 0x00000000, 0x80868309, 0x2bed4832, 0x1170ac1e, 0x5a724e6c,
+        0x0efffbfd, 0x8538560f, 0xaed51e3d, 0x2d392736, 0x0fd9640a, 0x5ca62168, 0x5b54d19b, 0x362e3a24,
+        0x0a67b10c, 0x57e70f93, 0xee96d2b4, 0x9b919e1b, 0xc0c54f80, 0xdc20a261, 0x774b695a, 0x121a161c,
+        0x93ba0ae2, 0xa02ae5c0, 0x22e0433c, 0x1b171d12, 0x090d0b0e, 0x8bc7adf2, 0xb6a8b92d, 0x1ea9c814,
+        0xf1198557, 0x75074caf, 0x99ddbbee, 0x7f60fda3, 0x01269ff7, 0x72f5bc5c, 0x663bc544, 0xfb7e345b,
+        0x4329768b, 0x23c6dccb, 0xedfc68b6, 0xe4f163b8, 0x31dccad7, 0x63851042, 0x97224013, 0xc6112084,
+        0x4a247d85, 0xbb3df8d2, 0xf93211ae, 0x29a16dc7, 0x9e2f4b1d, 0xb230f3dc, 0x8652ec0d, 0xc1e3d077,
+        0xb3166c2b, 0x70b999a9, 0x9448fa11, 0xe9642247, 0xfc8cc4a8, 0xf03f1aa0, 0x7d2cd856, 0x3390ef22,
+        0x494ec787, 0x38d1c1d9, 0xcaa2fe8c, 0xd40b3698, 0xf581cfa6, 0x7ade28a5, 0xb78e26da, 0xadbfa43f,
+        0x3a9de42c, 0x78920d50, 0x5fcc9b6a, 0x7e466254, 0x8d13c2f6, 0xd8b8e890, 0x39f75e2e, 0xc3aff582,
+        0x5d80be9f, 0xd0937c69, 0xd52da96f, 0x2512b3cf, 0xac993bc8, 0x187da710, 0x9c636ee8, 0x3bbb7bdb,
+        0x267809cd, 0x5918f46e, 0x9ab701ec, 0x4f9aa883, 0x956e65e6, 0xffe67eaa, 0xbccf0821, 0x15e8e6ef,
+        0xe79bd9ba, 0x6f36ce4a, 0x9f09d4ea, 0xb07cd629, 0xa4b2af31, 0x3f23312a, 0xa59430c6, 0xa266c035,
+        0x4ebc3774, 0x82caa6fc, 0x90d0b0e0, 0xa7d81533, 0x04984af1, 0xecdaf741, 0xcd500e7f, 0x91f62f17,
+        0x4dd68d76, 0xefb04d43, 0xaa4d54cc, 0x9604dfe4, 0xd1b5e39e, 0x6a881b4c, 0x2c1fb8c1, 0x65517f46,
+        0x5eea049d, 0x8c355d01, 0x877473fa, 0x0b412efb, 0x671d5ab3, 0xdbd25292, 0x105633e9, 0xd647136d,
+        0xd7618c9a, 0xa10c7a37, 0xf8148e59, 0x133c89eb, 0xa927eece, 0x61c935b7, 0x1ce5ede1, 0x47b13c7a,
+        0xd2df599c, 0xf2733f55, 0x14ce7918, 0xc737bf73, 0xf7cdea53, 0xfdaa5b5f, 0x3d6f14df, 0x44db8678,
+        0xaff381ca, 0x68c43eb9, 0x24342c38, 0xa3405fc2, 0x1dc37216, 0xe2250cbc, 0x3c498b28, 0x0d9541ff,
+        0xa8017139, 0x0cb3de08, 0xb4e49cd8, 0x56c19064, 0xcb84617b, 0x32b670d5, 0x6c5c7448, 0xb85742d0,
+    },
+#endif
+};
+#endif
 
-    initialize_aes_sbox(sbox);
+static const uint8_t aes_rcon[AES_MAXNR + 1] = {
+    0x00, 0x01, 0x02, 0x04, 0x08, 0x10, 0x20, 0x40, 0x80, 0x1b, 0x36
+};
 
-    for (i = 0; i < 256; i++) inv_sbox[sbox[i]] = i;
-}
+static inline __attribute__((always_inline)) uint32_t AES_decrypt_one_row_opt(uint32_t v1);
+#if AES_BITSLICE >= 1
+static void AES_bitslice_ortho(uint32_t *q);
+#endif
 
 int AES_set_encrypt_key(const uint8_t *userKey, const uint32_t bits, AES_KEY *key)
 {
@@ -77,14 +250,13 @@ int AES_set_encrypt_key(const uint8_t *userKey, const uint32_t bits, AES_KEY *ke
     if (bits != 128) return -1;
 
     key->rounds = 10;
-    initialize_aes_sbox(key->sbox);
 
     v1 = key->rd_key[0] = SWAP(*(uint32_t *)(userKey +  0));
     v2 = key->rd_key[1] = SWAP(*(uint32_t *)(userKey +  4));
     v3 = key->rd_key[2] = SWAP(*(uint32_t *)(userKey +  8));
     v4 = key->rd_key[3] = SWAP(*(uint32_t *)(userKey + 12));
 
-    uint8_t *sbox = key->sbox;
+    const uint8_t *sbox = aes_sbox;
 
     for (i = 1; i <= (uint32_t)key->rounds; i++) {
         v5 = sbox[(v4 >> 24) & 0xff] <<  0 |
@@ -97,10 +269,28 @@ int AES_set_encrypt_key(const uint8_t *userKey, const uint32_t bits, AES_KEY *ke
         key->rd_key[4 * i + 3] = v4 = v3 ^ v4;
     }
 
+#if AES_TD_TABLES >= 1
+    for (i = 0; i < 4 * (uint32_t)(key->rounds - 1); i++) {
+        key->dk_key[i] = AES_decrypt_one_row_opt(key->rd_key[4 + i]);
+    }
+#endif
+
+#if AES_BITSLICE >= 1
+    /* Same round key for both blocks */
+    for (i = 0; i <= (uint32_t)key->rounds; i++) {
+        uint32_t *sk = key->bs_key + 8 * i;
+
+        for (v5 = 0; v5 < 4; v5++) {
+            sk[2 * v5 + 0] = sk[2 * v5 + 1] = __builtin_bswap32(key->rd_key[4 * i + v5]);
+        }
+        AES_bitslice_ortho(sk);
+    }
+#endif
+
     return 0;
 }
 
-static uint32_t AES_encrypt_one_row_opt(uint32_t v1)
+static inline __attribute__((always_inline)) uint32_t AES_encrypt_one_row_opt(uint32_t v1)
 {
     uint32_t v2, v3;
 
@@ -111,16 +301,16 @@ static uint32_t AES_encrypt_one_row_opt(uint32_t v1)
     return v1;
 }
 
-void AES_encrypt(const uint8_t *text, uint8_t *cipher, const AES_KEY *key)
+static inline __attribute__((always_inline)) void AES_encrypt_block(const uint32_t *in, uint32_t *out, const AES_KEY *key)
 {
     uint32_t v20, v1, v2, v3, v4;
     uint32_t v11, v12, v13, v14;
-    const uint8_t *sbox = key->sbox;
+    const uint8_t *sbox = aes_sbox;
 
-    v1 = key->rd_key[0] ^ SWAP(*(uint32_t *)(text +  0));
-    v2 = key->rd_key[1] ^ SWAP(*(uint32_t *)(text +  4));
-    v3 = key->rd_key[2] ^ SWAP(*(uint32_t *)(text +  8));
-    v4 = key->rd_key[3] ^ SWAP(*(uint32_t *)(text + 12));
+    v1 = key->rd_key[0] ^ SWAP(in[0]);
+    v2 = key->rd_key[1] ^ SWAP(in[1]);
+    v3 = key->rd_key[2] ^ SWAP(in[2]);
+    v4 = key->rd_key[3] ^ SWAP(in[3]);
 
     for (v20 = 1; v20 < (uint32_t)key->rounds; v20++) {
         v11 = sbox[(v1 >> 24) & 0xFF] << 24 | sbox[(v2 >> 16) & 0xFF] << 16 | sbox[(v3 >>  8) & 0xFF] <<  8 | sbox[(v4 >>  0) & 0xFF] <<  0;
@@ -257,30 +447,53 @@ void AES_encrypt(const uint8_t *text, uint8_t *cipher, const AES_KEY *key)
     }
 
     // v1 v2, v3, v4
-    *(uint32_t *)(cipher +  0) = SWAP(key->rd_key[4 * v20 + 0] ^
+    out[0] = SWAP(key->rd_key[4 * v20 + 0] ^
             (sbox[(v1 >> 24) & 0xFF] << 24 | sbox[(v2 >> 16) & 0xFF] << 16 | sbox[(v3 >>  8) & 0xFF] <<  8 | sbox[(v4 >>  0) & 0xFF] <<  0));
 
-    *(uint32_t *)(cipher +  4) = SWAP(key->rd_key[4 * v20 + 1] ^
+    out[1] = SWAP(key->rd_key[4 * v20 + 1] ^
             (sbox[(v1 >>  0) & 0xFF] <<  0 | sbox[(v2 >> 24) & 0xFF] << 24 | sbox[(v3 >> 16) & 0xFF] << 16 | sbox[(v4 >>  8) & 0xFF] <<  8));
 
-    *(uint32_t *)(cipher +  8) = SWAP(key->rd_key[4 * v20 + 2] ^
+    out[2] = SWAP(key->rd_key[4 * v20 + 2] ^
             (sbox[(v1 >>  8) & 0xFF] <<  8 | sbox[(v2 >>  0) & 0xFF] <<  0 | sbox[(v3 >> 24) & 0xFF] << 24 | sbox[(v4 >> 16) & 0xFF] << 16));
 
-    *(uint32_t *)(cipher + 12) = SWAP(key->rd_key[4 * v20 + 3] ^
+    out[3] = SWAP(key->rd_key[4 * v20 + 3] ^
             (sbox[(v1 >> 16) & 0xFF] << 16 | sbox[(v2 >>  8) & 0xFF] <<  8 | sbox[(v3 >>  0) & 0xFF] <<  0 | sbox[(v4 >> 24) & 0xFF] << 24));
 }
 
+/* Word aligned buffers are used in place, others bounce through the stack */
+#define AES_ALIGNED(in, out)               ((((uintptr_t)(in) | (uintptr_t)(out)) & 3) == 0)
+
+AES_RAMFUNC void AES_encrypt_blocks(const uint8_t *in, uint8_t *out, uint32_t nblocks, const AES_KEY *key)
+{
+    uint32_t buf[4];
+
+    if (AES_ALIGNED(in, out)) {
+        for (; nblocks > 0; nblocks--, in += 16, out += 16) {
+            AES_encrypt_block((const uint32_t *)in, (uint32_t *)out, key);
+        }
+    } else {
+        for (; nblocks > 0; nblocks--, in += 16, out += 16) {
+            memcpy(buf, in, 16);
+            AES_encrypt_block(buf, buf, key);
+            memcpy(out, buf, 16);
+        }
+    }
+}
+
+AES_RAMFUNC void AES_encrypt(const uint8_t *text, uint8_t *cipher, const AES_KEY *key)
+{
+    AES_encrypt_blocks(text, cipher, 1, key);
+}
+
 int AES_set_decrypt_key(const uint8_t *userKey, const uint32_t bits, AES_KEY *key)
 {
     if (bits != 128) return -1;
 
-    AES_set_encrypt_key(userKey, bits, key);
-    initialize_aes_inv_sbox(key->sbox);
-
-    return 0;
+    /* The inverse cipher walks the encryption schedule backwards */
+    return AES_set_encrypt_key(userKey, bits, key);
 }
 
-static uint32_t AES_decrypt_one_row_opt(uint32_t v1)
+static inline __attribute__((always_inline)) uint32_t AES_decrypt_one_row_opt(uint32_t v1)
 {
     uint32_t v2, v3, v4, v5, v6, v7, v8;
 
@@ -295,17 +508,31 @@ static uint32_t AES_decrypt_one_row_opt(uint32_t v1)
     return v2 ^ v3 ^ v4 ^ v6 ^ v7 ^ v8;
 }
 
-void AES_decrypt(const uint8_t *cipher, uint8_t *text, const AES_KEY *key)
+static inline __attribute__((always_inline)) void AES_decrypt_block(const uint32_t *in, uint32_t *out, const AES_KEY *key)
 {
     uint32_t v1, v2, v3, v4, v11, v12, v13, v14;
     uint32_t v20 = key->rounds;
-    const uint8_t *inv_sbox = key->sbox;
+    const uint8_t *inv_sbox = aes_inv_sbox;
 
-    v1 = SWAP(*(uint32_t *)(cipher +  0)) ^ key->rd_key[v20 * 4 + 0];
-    v2 = SWAP(*(uint32_t *)(cipher +  4)) ^ key->rd_key[v20 * 4 + 1];
-    v3 = SWAP(*(uint32_t *)(cipher +  8)) ^ key->rd_key[v20 * 4 + 2];
-    v4 = SWAP(*(uint32_t *)(cipher + 12)) ^ key->rd_key[v20 * 4 + 3];
+    v1 = SWAP(in[0]) ^ key->rd_key[v20 * 4 + 0];
+    v2 = SWAP(in[1]) ^ key->rd_key[v20 * 4 + 1];
+    v3 = SWAP(in[2]) ^ key->rd_key[v20 * 4 + 2];
+    v4 = SWAP(in[3]) ^ key->rd_key[v20 * 4 + 3];
 
+#if AES_TD_TABLES >= 1
+    for (v20--; v20 >= 1; v20--) {
+        /* Equivalent inverse cipher: InvMixColumns(x ^ k) == InvMixColumns(x) ^ dk */
+        v11 = key->dk_key[v20 * 4 - 4] ^ TD0((v1 >> 24) & 0xff) ^ TD1((v4 >> 16) & 0xff) ^ TD2((v3 >>  8) & 0xff) ^ TD3((v2 >>  0) & 0xff);
+        v12 = key->dk_key[v20 * 4 - 3] ^ TD0((v2 >> 24) & 0xff) ^ TD1((v1 >> 16) & 0xff) ^ TD2((v4 >>  8) & 0xff) ^ TD3((v3 >>  0) & 0xff);
+        v13 = key->dk_key[v20 * 4 - 2] ^ TD0((v3 >> 24) & 0xff) ^ TD1((v2 >> 16) & 0xff) ^ TD2((v1 >>  8) & 0xff) ^ TD3((v4 >>  0) & 0xff);
+        v14 = key->dk_key[v20 * 4 - 1] ^ TD0((v4 >> 24) & 0xff) ^ TD1((v3 >> 16) & 0xff) ^ TD2((v2 >>  8) & 0xff) ^ TD3((v1 >>  0) & 0xff);
+
+        v1 = v11;
+        v2 = v12;
+        v3 = v13;
+        v4 = v14;
+    }
+#else
     for (v20--; v20 >= 1; v20--) {
         v11 = key->rd_key[v20 * 4 + 0] ^ (
              inv_sbox[(v1 >> 24) & 0xff] << 24 |
@@ -349,6 +576,7 @@ void AES_decrypt(const uint8_t *cipher, uint8_t *text, const AES_KEY *key)
         v3 = AES_decrypt_one_row_opt(v13);
         v4 = AES_decrypt_one_row_opt(v14);
     }
+#endif
 
     v11 = inv_sbox[(v1 >> 24) & 0xff] << 24 | inv_sbox[(v4 >> 16) & 0xff] << 16 |
          inv_sbox[(v3 >>  8) & 0xff] <<  8 | inv_sbox[(v2 >>  0) & 0xff] <<  0;
@@ -362,8 +590,267 @@ void AES_decrypt(const uint8_t *cipher, uint8_t *text, const AES_KEY *key)
     v14 = inv_sbox[(v4 >> 24) & 0xff] << 24 | inv_sbox[(v3 >> 16) & 0xff] << 16 |
          inv_sbox[(v2 >>  8) & 0xff] <<  8 | inv_sbox[(v1 >>  0) & 0xff] <<  0;
 
-    *(uint32_t *)(text +  0) = SWAP(key->rd_key[0] ^ v11);
-    *(uint32_t *)(text +  4) = SWAP(key->rd_key[1] ^ v12);
-    *(uint32_t *)(text +  8) = SWAP(key->rd_key[2] ^ v13);
-    *(uint32_t *)(text + 12) = SWAP(key->rd_key[3] ^ v14);
+    out[0] = SWAP(key->rd_key[0] ^ v11);
+    out[1] = SWAP(key->rd_key[1] ^ v12);
+    out[2] = SWAP(key->rd_key[2] ^ v13);
+    out[3] = SWAP(key->rd_key[3] ^ v14);
+}
+
+#if AES_BITSLICE >= 1
+/*
+ * Bitsliced decrypt of two blocks at once: q[i] holds bit i of all 32 state
+ * bytes, byte lane r of each word is row r and bit 2 * c + b in the lane is
+ * column c of block b. There are no table lookups, the run time does not
+ * depend on the data nor on flash wait states for the tables.
+ */
+#define SWAPMOVE(a, b, mask, n)            do {                                \
+        uint32_t t = ((b) ^ ((a) >> (n))) & (mask);                            \
+        (b) ^= t;                                                              \
+        (a) ^= t << (n);                                                       \
+    } while (0)
+
+/* 8x8 bit transpose in each byte lane, its own inverse */
+static void AES_bitslice_ortho(uint32_t *q)
+{
+    SWAPMOVE(q[0], q[1], 0x55555555, 1);
+    SWAPMOVE(q[2], q[3], 0x55555555, 1);
+    SWAPMOVE(q[4], q[5], 0x55555555, 1);
+    SWAPMOVE(q[6], q[7], 0x55555555, 1);
+
+    SWAPMOVE(q[0], q[2], 0x33333333, 2);
+    SWAPMOVE(q[1], q[3], 0x33333333, 2);
+    SWAPMOVE(q[4], q[6], 0x33333333, 2);
+    SWAPMOVE(q[5], q[7], 0x33333333, 2);
+
+    SWAPMOVE(q[0], q[4], 0x0f0f0f0f, 4);
+    SWAPMOVE(q[1], q[5], 0x0f0f0f0f, 4);
+    SWAPMOVE(q[2], q[6], 0x0f0f0f0f, 4);
+    SWAPMOVE(q[3], q[7], 0x0f0f0f0f, 4);
+}
+
+// Boyar-Peralta S-box circuit: http://eprint.iacr.org/2011/332
+static inline __attribute__((always_inline)) void AES_bitslice_sbox(uint32_t *q)
+{
+    uint32_t x0, x1, x2, x3, x4, x5, x6, x7;
+    uint32_t y1, y2, y3, y4, y5, y6, y7, y8, y9, y10, y11;
+    uint32_t y12, y13, y14, y15, y16, y17, y18, y19, y20, y21;
+    uint32_t z0, z1, z2, z3, z4, z5, z6, z7, z8;
+    uint32_t z9, z10, z11, z12, z13, z14, z15, z16, z17;
+    uint32_t t0, t1, t2, t3, t4, t5, t6, t7, t8, t9;
+    uint32_t t10, t11, t12, t13, t14, t15, t16, t17, t18, t19;
+    uint32_t t20, t21, t22, t23, t24, t25, t26, t27, t28, t29;
+    uint32_t t30, t31, t32, t33, t34, t35, t36, t37, t38, t39;
+    uint32_t t40, t41, t42, t43, t44, t45, t46, t47, t48, t49;
+    uint32_t t50, t51, t52, t53, t54, t55, t56, t57, t58, t59;
+    uint32_t t60, t61, t62, t63, t64, t65, t66, t67;
+    uint32_t s0, s1, s2, s3, s4, s5, s6, s7;
+
+    x0 = q[7]; x1 = q[6]; x2 = q[5]; x3 = q[4];
+    x4 = q[3]; x5 = q[2]; x6 = q[1]; x7 = q[0];
+
+    // Top linear transformation
+    y14 = x3 ^ x5;   y13 = x0 ^ x6;   y9 = x0 ^ x3;    y8 = x0 ^ x5;
+    t0 = x1 ^ x2;    y1 = t0 ^ x7;    y4 = y1 ^ x3;    y12 = y13 ^ y14;
+    y2 = y1 ^ x0;    y5 = y1 ^ x6;    y3 = y5 ^ y8;    t1 = x4 ^ y12;
+    y15 = t1 ^ x5;   y20 = t1 ^ x1;   y6 = y15 ^ x7;   y10 = y15 ^ t0;
+    y11 = y20 ^ y9;  y7 = x7 ^ y11;   y17 = y10 ^ y11; y19 = y10 ^ y8;
+    y16 = t0 ^ y11;  y21 = y13 ^ y16; y18 = x0 ^ y16;
+
+    // Non-linear section
+    t2 = y12 & y15;  t3 = y3 & y6;    t4 = t3 ^ t2;    t5 = y4 & x7;
+    t6 = t5 ^ t2;    t7 = y13 & y16;  t8 = y5 & y1;    t9 = t8 ^ t7;
+    t10 = y2 & y7;   t11 = t10 ^ t7;  t12 = y9 & y11;  t13 = y14 & y17;
+    t14 = t13 ^ t12; t15 = y8 & y10;  t16 = t15 ^ t12; t17 = t4 ^ t14;
+    t18 = t6 ^ t16;  t19 = t9 ^ t14;  t20 = t11 ^ t16; t21 = t17 ^ y20;
+    t22 = t18 ^ y19; t23 = t19 ^ y21; t24 = t20 ^ y18;
+
+    t25 = t21 ^ t22; t26 = t21 & t23; t27 = t24 ^ t26; t28 = t25 & t27;
+    t29 = t28 ^ t22; t30 = t23 ^ t24; t31 = t22 ^ t26; t32 = t31 & t30;
+    t33 = t32 ^ t24; t34 = t23 ^ t33; t35 = t27 ^ t33; t36 = t24 & t35;
+    t37 = t36 ^ t34; t38 = t27 ^ t36; t39 = t29 & t38; t40 = t25 ^ t39;
+
+    t41 = t40 ^ t37; t42 = t29 ^ t33; t43 = t29 ^ t40; t44 = t33 ^ t37;
+    t45 = t42 ^ t41;
+    z0 = t44 & y15;  z1 = t37 & y6;   z2 = t33 & x7;   z3 = t43 & y16;
+    z4 = t40 & y1;   z5 = t29 & y7;   z6 = t42 & y11;  z7 = t45 & y17;
+    z8 = t41 & y10;  z9 = t44 & y12;  z10 = t37 & y3;  z11 = t33 & y4;
+    z12 = t43 & y13; z13 = t40 & y5;  z14 = t29 & y2;  z15 = t42 & y9;
+    z16 = t45 & y14; z17 = t41 & y8;
+
+    // Bottom linear transformation
+    t46 = z15 ^ z16; t47 = z10 ^ z11; t48 = z5 ^ z13;  t49 = z9 ^ z10;
+    t50 = z2 ^ z12;  t51 = z2 ^ z5;   t52 = z7 ^ z8;   t53 = z0 ^ z3;
+    t54 = z6 ^ z7;   t55 = z16 ^ z17; t56 = z12 ^ t48; t57 = t50 ^ t53;
+    t58 = z4 ^ t46;  t59 = z3 ^ t54;  t60 = t46 ^ t57; t61 = z14 ^ t57;
+    t62 = t52 ^ t58; t63 = t49 ^ t58; t64 = z4 ^ t59;  t65 = t61 ^ t62;
+    t66 = z1 ^ t63;  s0 = t59 ^ t63;  s6 = t56 ^ ~t62; s7 = t48 ^ ~t60;
+    t67 = t64 ^ t65; s3 = t53 ^ t66;  s4 = t51 ^ t66;  s5 = t47 ^ t65;
+    s1 = t64 ^ ~s3;  s2 = t55 ^ ~t67;
+
+    q[7] = s0; q[6] = s1; q[5] = s2; q[4] = s3;
+    q[3] = s4; q[2] = s5; q[1] = s6; q[0] = s7;
+}
+
+/* Inverse affine transformation, x -> A^-1(x ^ 0x63) */
+static inline __attribute__((always_inline)) void AES_bitslice_inv_affine(uint32_t *q)
+{
+    uint32_t q0 = q[0], q1 = q[1], q2 = q[2], q3 = q[3];
+    uint32_t q4 = q[4], q5 = q[5], q6 = q[6], q7 = q[7];
+
+    q[0] = ~(q2 ^ q5 ^ q7);
+    q[1] = q3 ^ q6 ^ q0;
+    q[2] = ~(q4 ^ q7 ^ q1);
+    q[3] = q5 ^ q0 ^ q2;
+    q[4] = q6 ^ q1 ^ q3;
+    q[5] = q7 ^ q2 ^ q4;
+    q[6] = q0 ^ q3 ^ q5;
+    q[7] = q1 ^ q4 ^ q6;
+}
+
+/* InvSubBytes(x) = T(SubBytes(T(x))) with T the inverse affine transformation */
+static inline __attribute__((always_inline)) void AES_bitslice_inv_sbox(uint32_t *q)
+{
+    AES_bitslice_inv_affine(q);
+    AES_bitslice_sbox(q);
+    AES_bitslice_inv_affine(q);
+}
+
+/* Row r moves r columns to the right: rotate byte lane r left by 2 * r bits */
+static inline __attribute__((always_inline)) void AES_bitslice_inv_shift_rows(uint32_t *q)
+{
+    uint32_t i, x;
+
+    for (i = 0; i < 8; i++) {
+        x = q[i];
+        q[i] = (x & 0x000000ff) |
+                (x & 0x00003f00) << 2 | (x & 0x0000c000) >> 6 |
+                (x & 0x000f0000) << 4 | (x & 0x00f00000) >> 4 |
+                (x & 0x03000000) << 6 | (x & 0xfc000000) >> 2;
+    }
+}
+
+/* Multiply every state byte by 0x02 */
+static inline __attribute__((always_inline)) void AES_bitslice_xtime(uint32_t *v)
+{
+    uint32_t h = v[7];
+
+    v[7] = v[6];
+    v[6] = v[5];
+    v[5] = v[4];
+    v[4] = v[3] ^ h;
+    v[3] = v[2] ^ h;
+    v[2] = v[1];
+    v[1] = v[0] ^ h;
+    v[0] = h;
+}
+
+/*
+ * [ 0e 0b 0d 09 ]   [ 02 03 01 01 ]   [ 05 00 04 00 ]
+ * [ 09 0e 0b 0d ] = [ 01 02 03 01 ] * [ 00 05 00 04 ]
+ * [ 0d 09 0e 0b ]   [ 01 01 02 03 ]   [ 04 00 05 00 ]
+ * [ 0b 0d 09 0e ]   [ 03 01 01 02 ]   [ 00 04 00 05 ]
+ *
+ * ROTATE(x, 24) brings row r + 1 to lane r, ROTATE(x, 16) row r + 2.
+ */
+static inline __attribute__((always_inline)) void AES_bitslice_inv_mix_columns(uint32_t *q)
+{
+    uint32_t i, r[8], u[8];
+
+    for (i = 0; i < 8; i++) {
+        u[i] = q[i] ^ ROTATE(q[i], 16);
+    }
+    AES_bitslice_xtime(u);
+    AES_bitslice_xtime(u);
+    for (i = 0; i < 8; i++) {
+        q[i] ^= u[i];
+        r[i] = ROTATE(q[i], 24);
+        u[i] = q[i] ^ r[i];
+    }
+
+    AES_bitslice_xtime(u);
+    for (i = 0; i < 8; i++) {
+        q[i] = u[i] ^ r[i] ^ ROTATE(q[i] ^ r[i], 16);
+    }
+}
+
+static inline __attribute__((always_inline)) void AES_bitslice_add_round_key(uint32_t *q, const uint32_t *sk)
+{
+    uint32_t i;
+
+    for (i = 0; i < 8; i++) {
+        q[i] ^= sk[i];
+    }
+}
+
+static inline __attribute__((always_inline)) void AES_decrypt2_block(const uint32_t *in, uint32_t *out, const AES_KEY *key)
+{
+    uint32_t i, q[8];
+    int32_t round;
+
+    for (i = 0; i < 4; i++) {
+        q[2 * i + 0] = __builtin_bswap32(SWAP(in[0 + i]));
+        q[2 * i + 1] = __builtin_bswap32(SWAP(in[4 + i]));
+    }
+    AES_bitslice_ortho(q);
+
+    AES_bitslice_add_round_key(q, key->bs_key + 8 * key->rounds);
+    for (round = key->rounds - 1; round >= 1; round--) {
+        AES_bitslice_inv_shift_rows(q);
+        AES_bitslice_inv_sbox(q);
+        AES_bitslice_add_round_key(q, key->bs_key + 8 * round);
+        AES_bitslice_inv_mix_columns(q);
+    }
+    AES_bitslice_inv_shift_rows(q);
+    AES_bitslice_inv_sbox(q);
+    AES_bitslice_add_round_key(q, key->bs_key);
+
+    AES_bitslice_ortho(q);
+    for (i = 0; i < 4; i++) {
+        out[0 + i] = SWAP(__builtin_bswap32(q[2 * i + 0]));
+        out[4 + i] = SWAP(__builtin_bswap32(q[2 * i + 1]));
+    }
+}
+#endif
+
+AES_RAMFUNC void AES_decrypt_blocks(const uint8_t *in, uint8_t *out, uint32_t nblocks, const AES_KEY *key)
+{
+#if AES_BITSLICE >= 1
+    uint32_t buf[8];
+
+    if (AES_ALIGNED(in, out)) {
+        for (; nblocks >= 2; nblocks -= 2, in += 32, out += 32) {
+            AES_decrypt2_block((const uint32_t *)in, (uint32_t *)out, key);
+        }
+    } else {
+        for (; nblocks >= 2; nblocks -= 2, in += 32, out += 32) {
+            memcpy(buf, in, 32);
+            AES_decrypt2_block(buf, buf, key);
+            memcpy(out, buf, 32);
+        }
+    }
+#else
+    uint32_t buf[4];
+#endif
+
+    if (AES_ALIGNED(in, out)) {
+        for (; nblocks > 0; nblocks--, in += 16, out += 16) {
+            AES_decrypt_block((const uint32_t *)in, (uint32_t *)out, key);
+        }
+    } else {
+        for (; nblocks > 0; nblocks--, in += 16, out += 16) {
+            memcpy(buf, in, 16);
+            AES_decrypt_block(buf, buf, key);
+            memcpy(out, buf, 16);
+        }
+    }
+}
+
+AES_RAMFUNC void AES_decrypt(const uint8_t *cipher, uint8_t *text, const AES_KEY *key)
+{
+    AES_decrypt_blocks(cipher, text, 1, key);
+}
+
+AES_RAMFUNC void AES_decrypt2(const uint8_t *cipher, uint8_t *text, const AES_KEY *key)
+{
+    AES_decrypt_blocks(cipher, text, 2, key);
 }
@@ -19,7 +19,6 @@
 
 
 #define AES_MAXNR        10
-#define ROTL8(x,shift) ((uint8_t) ((x) << (shift)) | ((x) >> (8 - (shift))))
 
 #undef ROTATE
 #if defined(_MSC_VER) || defined(__ICC)
@@ -47,16 +46,68 @@
 # endif
 #endif
 
+/*
+ * AES_IN_RAM: 0 - S-boxes and round code in flash
+ *             1 - S-boxes in SRAM
+ *             2 - S-boxes and AES_encrypt/AES_decrypt in SRAM
+ */
+#if !defined(AES_IN_RAM)
+#define AES_IN_RAM       0
+#endif
+
+#if AES_IN_RAM >= 2 && defined(__arm__)
+#define AES_RAMFUNC      __attribute__((section(".ramtext"), long_call, noinline))
+#else
+#define AES_RAMFUNC
+#endif
+
+/*
+ * AES_TD_TABLES: 0 - InvMixColumns computed per column, no tables
+ *                1 - one 1 KB Td table, rotated per byte lane
+ *                4 - four 1 KB Td tables
+ */
+#if !defined(AES_TD_TABLES)
+#define AES_TD_TABLES    0
+#endif
+
+#if AES_TD_TABLES != 0 && AES_TD_TABLES != 1 && AES_TD_TABLES != 4
+#error "AES_TD_TABLES must be 0, 1 or 4"
+#endif
+
+/*
+ * AES_BITSLICE: 0 - AES_decrypt2 runs AES_decrypt on each block
+ *               1 - AES_decrypt2 is bitsliced, constant time
+ */
+#if !defined(AES_BITSLICE)
+#define AES_BITSLICE     0
+#endif
+
 typedef struct {
     uint32_t rd_key[4 * (AES_MAXNR + 1)];
     int32_t rounds;
-    uint8_t sbox[256];
+#if AES_TD_TABLES >= 1
+    /* InvMixColumns of the inner round keys, for the Td table rounds */
+    uint32_t dk_key[4 * (AES_MAXNR - 1)];
+#endif
+#if AES_BITSLICE >= 1
+    /* Bitsliced round keys, see AES_decrypt2 */
+    uint32_t bs_key[8 * (AES_MAXNR + 1)];
+#endif
 } AES_KEY;
 
 int AES_set_encrypt_key(const uint8_t *userKey, const uint32_t bits, AES_KEY *key);
-void AES_encrypt(const uint8_t *text, uint8_t *cipher, const AES_KEY *key);
+AES_RAMFUNC void AES_encrypt(const uint8_t *text, uint8_t *cipher, const AES_KEY *key);
+
+/* ECB over nblocks consecutive blocks, in may equal out */
+AES_RAMFUNC void AES_encrypt_blocks(const uint8_t *in, uint8_t *out, uint32_t nblocks, const AES_KEY *key);
 
 int AES_set_decrypt_key(const uint8_t *userKey, const uint32_t bits, AES_KEY *key);
-void AES_decrypt(const uint8_t *cipher, uint8_t *text, const AES_KEY *key);
+AES_RAMFUNC void AES_decrypt(const uint8_t *cipher, uint8_t *text, const AES_KEY *key);
+
+/* ECB over nblocks consecutive blocks, in may equal out */
+AES_RAMFUNC void AES_decrypt_blocks(const uint8_t *in, uint8_t *out, uint32_t nblocks, const AES_KEY *key);
+
+/* Decrypts two consecutive blocks, 32 bytes */
+AES_RAMFUNC void AES_decrypt2(const uint8_t *cipher, uint8_t *text, const AES_KEY *key);
 
 #endif
@@ -20,10 +20,10 @@ const PALConfig pal_default_config =
  * Early initialization code.
  * This initialization must be performed just after stack setup and before
  * any other initialization.
+ * Note, main() brings the clocks up itself once it knows it is not starting
+ * the application straight away.
  */
 void __early_init(void) {
-
-  stm32_clock_init();
 }
 
 /*
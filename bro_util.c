@@ -25,6 +25,94 @@
 #include "bro_util.h"
 
 
+#define BDLOG_KIND_FMT          0
+#define BDLOG_KIND_HEX          1
+
+typedef struct {
+  const char *fmt;              /* Hexdump line: prefix, may be NULL */
+  union {
+    uintptr_t arg[BDLOG_MAX_ARGS];
+    uint8_t data[16];           /* Hexdump line: the bytes */
+  } u;
+  size_t offset;                /* Hexdump line: offset shown */
+  uint8_t kind;
+  uint8_t nargs;                /* Hexdump line: first byte shown */
+  uint8_t count;                /* Hexdump line: bytes shown */
+  uint8_t ready;                /* Written by the producer, published */
+} bdlog_rec_t;
+
+static bdlog_rec_t bdlog_ring[BDLOG_NUM];
+static uint32_t bdlog_head = 0;         /* Next slot to claim */
+static uint32_t bdlog_tail = 0;         /* Next slot to format */
+static uint32_t bdlog_dropped = 0;
+/* Signalled on every published record, the thread sleeps on it once the
+   ring is drained. Producers publish out of order, so "the ring was empty"
+   is not something a producer can tell */
+static BSEMAPHORE_DECL(bdlog_bsem, TRUE);
+
+/* Claims a slot with a CAS on the head, NULL when the ring is full */
+static bdlog_rec_t *bdlogClaim(void)
+{
+  uint32_t head = __atomic_load_n(&bdlog_head, __ATOMIC_RELAXED);
+
+  do {
+    if (head - __atomic_load_n(&bdlog_tail, __ATOMIC_ACQUIRE) >= BDLOG_NUM) {
+      __atomic_fetch_add(&bdlog_dropped, 1, __ATOMIC_RELAXED);
+      return NULL;
+    }
+  } while (!__atomic_compare_exchange_n(&bdlog_head, &head, head + 1, TRUE,
+        __ATOMIC_ACQ_REL, __ATOMIC_RELAXED));
+
+  return &bdlog_ring[head % BDLOG_NUM];
+}
+
+static void bdlogPublish(bdlog_rec_t *rec)
+{
+  __atomic_store_n(&rec->ready, 1, __ATOMIC_RELEASE);
+  chBSemSignal(&bdlog_bsem);
+}
+
+void bdlogWrite(const char *fmt, int nargs, ...)
+{
+  bdlog_rec_t *rec = bdlogClaim();
+  va_list ap;
+  int i;
+
+  if (rec == NULL) {
+    return;
+  }
+
+  rec->kind = BDLOG_KIND_FMT;
+  rec->fmt = fmt;
+  rec->nargs = nargs;
+  va_start(ap, nargs);
+  for (i = 0; i < nargs && i < BDLOG_MAX_ARGS; i++) {
+    rec->u.arg[i] = va_arg(ap, uintptr_t);
+  }
+  va_end(ap);
+
+  bdlogPublish(rec);
+}
+
+/* Takes the oldest record once its producer published it */
+static bool bdlogTake(bdlog_rec_t *rec)
+{
+  uint32_t tail = bdlog_tail;
+  bdlog_rec_t *slot = &bdlog_ring[tail % BDLOG_NUM];
+
+  if (tail == __atomic_load_n(&bdlog_head, __ATOMIC_ACQUIRE) ||
+      !__atomic_load_n(&slot->ready, __ATOMIC_ACQUIRE)) {
+    return FALSE;
+  }
+
+  *rec = *slot;
+  slot->ready = 0;
+  __atomic_store_n(&bdlog_tail, tail + 1, __ATOMIC_RELEASE);
+
+  return TRUE;
+}
+
+
 int bdprintf(mutex_t *mtx, SerialDriver *sd, const char *fmt, ...)
 {
   va_list ap;
@@ -40,7 +128,63 @@ int bdprintf(mutex_t *mtx, SerialDriver *sd, const char *fmt, ...)
 }
 
 // https://android.googlesource.com/platform/art/+/android-7.0.0_r7/runtime/base/hex_dump.cc
-void hexdump(mutex_t *mtx, SerialDriver *chp, void *address_, int byte_count_, int show_actual_addresses_, const char *prefix_)
+#define kBitsPerWord 32
+
+/* 01234560: 00 11 22 33 44 55 66 77 88 99 aa bb cc dd ee ff    0123456789abcdef */
+#define HEXDUMP_LINE_SIZE ((kBitsPerWord / 4) + /* offset */ \
+                           1 + /* colon */ \
+                           (16 * 3) + /* 16 hex digits and space */ \
+                           2 + /* white space */ \
+                           16 + /* 16 characters*/ \
+                           1 /* \0 */)
+
+static void hexdumpLine(char *out, size_t line_offset, const uint8_t *addr, size_t gap, size_t count)
+{
+    static const char gHexDigit[] = "0123456789abcdef";
+
+    memset(out, ' ', HEXDUMP_LINE_SIZE - 1);
+    out[kBitsPerWord / 4] = ':';
+    out[HEXDUMP_LINE_SIZE - 1] = '\0';
+
+    char* hex = out;
+    char* asc = out + (kBitsPerWord / 4) + /* offset */ 1 + /* colon */
+            (16 * 3) + /* 16 hex digits and space */ 2 /* white space */;
+
+    size_t i;
+    for (i = 0; i < (kBitsPerWord / 4); i++) {
+        *hex++ = gHexDigit[(line_offset >> (kBitsPerWord - 4)) & 0x0f];
+        line_offset <<= 4;
+    }
+    hex++;
+    hex++;
+
+    if (gap) {
+        /* only on first line */
+        hex += gap * 3;
+        asc += gap;
+    }
+
+    for (i = gap ; i < count + gap; i++) {
+        *hex++ = gHexDigit[*addr >> 4];
+        *hex++ = gHexDigit[*addr & 0x0f];
+        hex++;
+        if (*addr >= 0x20 && *addr < 0x7f /*isprint(*addr)*/) {
+            *asc++ = *addr;
+        } else {
+            *asc++ = '.';
+        }
+        addr++;
+    }
+    for (; i < 16; i++) {
+        /* erase extra stuff; only happens on last line */
+        *hex++ = ' ';
+        *hex++ = ' ';
+        hex++;
+        *asc++ = ' ';
+    }
+}
+
+void hexdump(void *address_, int byte_count_, int show_actual_addresses_, const char *prefix_)
 {
 #define min(a, b) (a) > (b) ? (b) : (a)
     if (byte_count_ == 0) {
@@ -48,20 +192,11 @@ void hexdump(mutex_t *mtx, SerialDriver *chp, void *address_, int byte_count_, i
     }
 
     if (address_ == NULL) {
-        bdprintf(mtx, chp, "00000000:");
+        bdlog("00000000:");
         return;
     }
 
-    static const char gHexDigit[] = "0123456789abcdef";
     const unsigned char* addr =(const unsigned char*)(address_);
-    const int kBitsPerWord = 32;
-    // 01234560: 00 11 22 33 44 55 66 77 88 99 aa bb cc dd ee ff    0123456789abcdef
-    char out[(kBitsPerWord / 4) + /* offset */
-                     1 + /* colon */
-                     (16 * 3) + /* 16 hex digits and space */
-                     2 + /* white space */
-                     16 + /* 16 characters*/
-                     1 /* \0 */ ];
     size_t offset;        /* offset to show while printing */
 
     if (show_actual_addresses_) {
@@ -69,60 +204,63 @@ void hexdump(mutex_t *mtx, SerialDriver *chp, void *address_, int byte_count_, i
     } else {
         offset = 0;
     }
-    memset(out, ' ', sizeof(out)-1);
-    out[kBitsPerWord / 4] = ':';
-    out[sizeof(out)-1] = '\0';
 
     size_t byte_count = byte_count_;
     size_t gap = offset & 0x0f;
     while (byte_count > 0) {
-        size_t line_offset = offset & ~0x0f;
-
-        char* hex = out;
-        char* asc = out + (kBitsPerWord / 4) + /* offset */ 1 + /* colon */
-                (16 * 3) + /* 16 hex digits and space */ 2 /* white space */;
-
-        size_t i;
-        for (i = 0; i < (kBitsPerWord / 4); i++) {
-            *hex++ = gHexDigit[(line_offset >> (kBitsPerWord - 4)) & 0x0f];
-            line_offset <<= 4;
-        }
-        hex++;
-        hex++;
-
         size_t count = min(byte_count, 16 - gap);
-        // CHECK_NE(count, 0U);
-        // CHECK_LE(count + gap, 16U);
+        bdlog_rec_t *rec = bdlogClaim();
 
-        if (gap) {
-            /* only on first line */
-            hex += gap * 3;
-            asc += gap;
+        /* The formatting is left to the bdlog thread */
+        if (rec != NULL) {
+            rec->kind = BDLOG_KIND_HEX;
+            rec->fmt = prefix_;
+            rec->offset = offset & ~0x0f;
+            rec->nargs = gap;
+            rec->count = count;
+            memcpy(rec->u.data, addr, count);
+            bdlogPublish(rec);
         }
 
-        for (i = gap ; i < count + gap; i++) {
-            *hex++ = gHexDigit[*addr >> 4];
-            *hex++ = gHexDigit[*addr & 0x0f];
-            hex++;
-            if (*addr >= 0x20 && *addr < 0x7f /*isprint(*addr)*/) {
-                *asc++ = *addr;
-            } else {
-                *asc++ = '.';
-            }
-            addr++;
-        }
-        for (; i < 16; i++) {
-            /* erase extra stuff; only happens on last line */
-            *hex++ = ' ';
-            *hex++ = ' ';
-            hex++;
-            *asc++ = ' ';
-        }
-
-        prefix_ != NULL ? bdprintf(mtx, chp, "%s %s\r\n", prefix_, out): bdprintf(mtx, chp, "%s\r\n", out);
-
+        addr += count;
         gap = 0;
         byte_count -= count;
         offset += count;
     }
 }
+
+static THD_WORKING_AREA(waBdlog, 512);
+static __attribute__((noreturn)) THD_FUNCTION(bdlogThread, arg)
+{
+  BaseSequentialStream *chp = (BaseSequentialStream *)arg;
+  char out[HEXDUMP_LINE_SIZE];
+  bdlog_rec_t rec;
+  uint32_t dropped;
+
+  chRegSetThreadName("bdlog");
+  while (true) {
+    dropped = __atomic_exchange_n(&bdlog_dropped, 0, __ATOMIC_RELAXED);
+    if (dropped != 0) {
+      chprintf(chp, "bdlog: %u records dropped\r\n", dropped);
+    }
+
+    if (!bdlogTake(&rec)) {
+      chBSemWait(&bdlog_bsem);
+      continue;
+    }
+
+    if (rec.kind == BDLOG_KIND_HEX) {
+      hexdumpLine(out, rec.offset, rec.u.data, rec.nargs, rec.count);
+      rec.fmt != NULL ? chprintf(chp, "%s %s\r\n", rec.fmt, out) : chprintf(chp, "%s\r\n", out);
+    } else {
+      /* Arguments past nargs are never read by the format */
+      chprintf(chp, rec.fmt, rec.u.arg[0], rec.u.arg[1], rec.u.arg[2], rec.u.arg[3]);
+    }
+  }
+}
+
+/* The thread should run below everything the log is about */
+void bdlogStart(SerialDriver *sd, tprio_t prio)
+{
+  chThdCreateStatic(waBdlog, sizeof(waBdlog), prio, bdlogThread, sd);
+}
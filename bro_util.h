@@ -20,7 +20,40 @@
 #include "ch.h"
 #include "hal.h"
 
+/* Records the log ring holds, power of 2 */
+#ifndef BDLOG_NUM
+#define BDLOG_NUM               32
+#endif
+
+#define BDLOG_MAX_ARGS          4
+
+#define BDLOG_NARGS_(_0, _1, _2, _3, _4, n, ...) n
+#define BDLOG_NARGS(...)        BDLOG_NARGS_(0, ##__VA_ARGS__, 4, 3, 2, 1, 0)
+
+/* Every argument goes through the varargs as the uintptr_t bdlogWrite reads */
+#define BDLOG_ARGS_0()
+#define BDLOG_ARGS_1(a)         , (uintptr_t)(a)
+#define BDLOG_ARGS_2(a, b)      , (uintptr_t)(a), (uintptr_t)(b)
+#define BDLOG_ARGS_3(a, b, c)   , (uintptr_t)(a), (uintptr_t)(b), (uintptr_t)(c)
+#define BDLOG_ARGS_4(a, b, c, d) , (uintptr_t)(a), (uintptr_t)(b), (uintptr_t)(c), (uintptr_t)(d)
+#define BDLOG_ARGS__(n)         BDLOG_ARGS_##n
+#define BDLOG_ARGS_(n)          BDLOG_ARGS__(n)
+
+/*
+ * Deferred chprintf: the format and up to 4 integer or pointer arguments go
+ * into a lock-free ring, the bdlog thread formats them to the serial port.
+ * Strings must outlive the record (literals). Never blocks, a full ring
+ * drops the record and counts it. Thread context only, it signals the
+ * bdlog thread.
+ */
+#define bdlog(fmt, ...)         bdlogWrite(fmt, BDLOG_NARGS(__VA_ARGS__) BDLOG_ARGS_(BDLOG_NARGS(__VA_ARGS__))(__VA_ARGS__))
+
+void bdlogStart(SerialDriver *sd, tprio_t prio);
+void bdlogWrite(const char *fmt, int nargs, ...);
+
+/* Blocking, formats into the serial port under the mutex */
 int bdprintf(mutex_t *mtx, SerialDriver *sd, const char *fmt, ...);
-void hexdump(mutex_t *mtx, SerialDriver *chp, void *address_, int byte_count_, int show_actual_addresses_, const char *prefix_);
+/* Deferred as bdlog, a record per line */
+void hexdump(void *address_, int byte_count_, int show_actual_addresses_, const char *prefix_);
 
 #endif
@@ -8,11 +8,121 @@
 
 #include "usbcfg.h"
 #include "bro_aes.h"
+#include "bro_util.h"
 
 
 #define MIN(a, b) ((a) <= (b) ? (a) : (b))
 
 
+/* DFU bStatus codes (DFU 1.1, 6.1.2), the flash helpers report with them */
+#define DFU_STATUS_OK                   0x00
+#define DFU_STATUS_ERR_TARGET           0x01
+#define DFU_STATUS_ERR_WRITE            0x03
+#define DFU_STATUS_ERR_ERASE            0x04
+#define DFU_STATUS_ERR_CHECK_ERASED     0x05
+#define DFU_STATUS_ERR_VERIFY           0x07
+#define DFU_STATUS_ERR_ADDRESS          0x08
+#define DFU_STATUS_ERR_UNKNOWN          0x0E
+
+/*===========================================================================*/
+/* Update path profiling                                                     */
+/*===========================================================================*/
+
+/* Stages of an update, timed with the cycle counter */
+#define DFU_PROF_USB_HEADER      0      /* Command block, host idle time included */
+#define DFU_PROF_USB_PAYLOAD     1
+#define DFU_PROF_KEY             2
+#define DFU_PROF_DECRYPT         3
+#define DFU_PROF_CHECKSUM        4
+#define DFU_PROF_ERASE           5
+#define DFU_PROF_PROGRAM         6
+#define DFU_PROF_STATUS          7
+#define DFU_PROF_NUM             8
+
+typedef struct {
+    uint32_t min;
+    uint32_t max;
+    uint64_t sum;
+    uint32_t count;
+} dfu_prof_t;
+
+static dfu_prof_t dfu_prof[DFU_PROF_NUM];
+
+static void dfuProfRecord(uint8_t stage, uint32_t cycles) {
+    dfu_prof_t *prof = &dfu_prof[stage];
+
+    chSysLock();
+    if (prof->count == 0 || cycles < prof->min) {
+        prof->min = cycles;
+    }
+    if (cycles > prof->max) {
+        prof->max = cycles;
+    }
+    prof->sum += cycles;
+    prof->count++;
+    chSysUnlock();
+}
+
+static void dfuProfSince(uint8_t stage, rtcnt_t start) {
+    dfuProfRecord(stage, chSysGetRealtimeCounterX() - start);
+}
+
+/*===========================================================================*/
+/* Telemetry on the trace endpoint                                           */
+/*===========================================================================*/
+
+/* Events, the argument and value of each in the comment */
+#define DFU_TRACE_USB_RESET      0x01   /* -, - */
+#define DFU_TRACE_CHUNK          0x02   /* -, sequence number */
+#define DFU_TRACE_ERASE_START    0x03   /* -, page */
+#define DFU_TRACE_ERASE_DONE     0x04   /* erased, page */
+#define DFU_TRACE_PROGRAM_DONE   0x05   /* bStatus, page of the first byte */
+#define DFU_TRACE_CHECKSUM_FAIL  0x06   /* -, sequence number */
+#define DFU_TRACE_DROPPED        0x7f   /* -, records lost since the last one */
+
+/* Page number from the start of the flash */
+#define DFU_TRACE_PAGE(addr)     ((uint16_t)(((addr) & 0x00ffffff) / FLASH_PAGE_SIZE))
+
+#define DFU_TRACE_NUM            64     /* Power of 2 */
+#define DFU_TRACE_PER_PACKET     8      /* 64 bytes packets */
+
+/* Little endian on the wire, the time is the cycle counter */
+typedef struct {
+    uint32_t time;
+    uint8_t event;
+    uint8_t arg;
+    uint16_t value;
+} dfu_trace_t;
+
+static dfu_trace_t dfu_trace[DFU_TRACE_NUM];
+static uint32_t dfu_trace_head = 0;
+static uint32_t dfu_trace_tail = 0;
+static uint32_t dfu_trace_dropped = 0;
+/* Taken while the ring is empty, the first record signals it */
+static BSEMAPHORE_DECL(dfu_trace_bsem, TRUE);
+
+/* Never waits for the host: a full ring drops the record */
+static void dfuTrace(uint8_t event, uint8_t arg, uint16_t value) {
+    rtcnt_t now = chSysGetRealtimeCounterX();
+    dfu_trace_t *rec;
+
+    chSysLock();
+    if (dfu_trace_head - dfu_trace_tail >= DFU_TRACE_NUM) {
+        dfu_trace_dropped++;
+    } else {
+        if (dfu_trace_head == dfu_trace_tail) {
+            chBSemSignalI(&dfu_trace_bsem);
+        }
+        rec = &dfu_trace[dfu_trace_head++ % DFU_TRACE_NUM];
+        rec->time = now;
+        rec->event = event;
+        rec->arg = arg;
+        rec->value = value;
+    }
+    chSchRescheduleS();
+    chSysUnlock();
+}
+
 /*===========================================================================*/
 /* On-chip Flash operation                                                   */
 /*===========================================================================*/
@@ -25,21 +135,66 @@ static void setupFlash(void) {
     while (!(RCC->CR & RCC_CR_HSIRDY)) {}
 }
 
-static bool flashErasePage(uint32_t pageAddr) {
-    FLASH->CR = FLASH_CR_PER;
+#define FLASH_PAGE_SIZE          1024
+/* The first 16 KB hold the bootloader, the application starts above */
+#define FLASH_APP_BASE           0x08004000
 
+/* Spin until the controller is done. The part has a single flash bank and
+   every fetch from it stalls while BSY is set: the other threads, the USB
+   interrupt and the scheduler all run from the flash, so there is nobody
+   to hand the core to meanwhile */
+static void flashWaitIdle(void) {
     while (FLASH->SR & FLASH_SR_BSY) {}
-    FLASH->AR = pageAddr;
-    FLASH->CR = FLASH_CR_STRT | FLASH_CR_PER;
-    while (FLASH->SR & FLASH_SR_BSY) {}
+}
 
-    /* TODO: verify the page was erased */
+/* End of the on-chip flash, from the flash size register */
+static uint32_t flashEnd(void) {
+    return FLASH_BASE + ((*(volatile uint32_t *)0x1FFFF7E0 & 0xffff) << 10);
+}
 
-    FLASH->CR = 0x00;
+static bool flashIsBlank(uint32_t addr, uint32_t len) {
+    const uint32_t *p = (const uint32_t *)addr;
+    uint32_t idx;
+
+    for (idx = 0; idx < len / 4; idx++) {
+        if (p[idx] != 0xffffffff) {
+            return FALSE;
+        }
+    }
 
     return TRUE;
 }
 
+static bool flashErasePage(uint32_t pageAddr) {
+    rtcnt_t start = chSysGetRealtimeCounterX();
+    bool erased;
+
+    pageAddr &= ~(uint32_t)(FLASH_PAGE_SIZE - 1);
+
+    /* An erase takes ~20 ms, reading the page back a few us */
+    erased = flashIsBlank(pageAddr, FLASH_PAGE_SIZE);
+    if (!erased) {
+        dfuTrace(DFU_TRACE_ERASE_START, 0, DFU_TRACE_PAGE(pageAddr));
+
+        flashWaitIdle();
+        FLASH->SR = FLASH_SR_EOP;
+        FLASH->CR = FLASH_CR_PER;
+
+        FLASH->AR = pageAddr;
+        FLASH->CR = FLASH_CR_STRT | FLASH_CR_PER;
+        flashWaitIdle();
+
+        FLASH->CR = 0x00;
+
+        erased = flashIsBlank(pageAddr, FLASH_PAGE_SIZE);
+        dfuTrace(DFU_TRACE_ERASE_DONE, erased, DFU_TRACE_PAGE(pageAddr));
+    }
+
+    dfuProfSince(DFU_PROF_ERASE, start);
+
+    return erased;
+}
+
 static void flashLock(void) {
     /* take down the HSI oscillator? it may be in use elsewhere */
 
@@ -55,27 +210,102 @@ static void flashUnlock(void) {
     }
 }
 
-static bool flashWriteWord(uint32_t addr, uint32_t word) {
-    uint32_t rwmVal = FLASH->CR;
-
+/*
+ * Program len bytes (even) from the half-word aligned src. PG stays set for
+ * the whole run, the error flags are sticky so they are checked once at the
+ * end, followed by a single compare of the programmed range. Half-words that
+ * already hold their value (0xffff on an erased page) are skipped.
+ */
+static uint8_t flashProgram(uint32_t addr, const uint8_t *src, uint32_t len) {
+    volatile uint16_t *dst = (volatile uint16_t *)addr;
+    const uint16_t *half = (const uint16_t *)src;
+    rtcnt_t start = chSysGetRealtimeCounterX();
+    uint32_t idx, sr;
+    uint8_t status = DFU_STATUS_OK;
+
+    flashWaitIdle();
+    FLASH->SR = FLASH_SR_EOP | FLASH_SR_PGERR | FLASH_SR_WRPRTERR;
     FLASH->CR = FLASH_CR_PG;
 
     /* Apparently we need not write to FLASH_AR and can
        simply do a native write of a half word */
-    while (FLASH->SR & FLASH_SR_BSY) {}
-    *(uint16_t *)(addr + 0) = (word >>  0) & 0xffff;
-    while (FLASH->SR & FLASH_SR_BSY) {}
-    *(uint16_t *)(addr + 2) = (word >> 16) & 0xffff;
-    while (FLASH->SR & FLASH_SR_BSY) {}
+    for (idx = 0; idx < len / 2; idx++) {
+        if (half[idx] != dst[idx]) {
+            dst[idx] = half[idx];
+            flashWaitIdle();
+        }
+    }
 
-    FLASH->CR = rwmVal & 0xfffffffe;
+    FLASH->CR &= ~FLASH_CR_PG;
 
-    /* Verify the write */
-    if (*(uint32_t *)addr != word) {
-        return FALSE;
+    sr = FLASH->SR;
+    if (sr & FLASH_SR_WRPRTERR) {
+        status = DFU_STATUS_ERR_WRITE;
+    } else if (sr & FLASH_SR_PGERR) { // Target was not erased
+        status = DFU_STATUS_ERR_CHECK_ERASED;
+    } else if (memcmp((const void *)addr, src, len) != 0) {
+        status = DFU_STATUS_ERR_VERIFY;
     }
 
-    return TRUE;
+    dfuProfSince(DFU_PROF_PROGRAM, start);
+    dfuTrace(DFU_TRACE_PROGRAM_DONE, status, DFU_TRACE_PAGE(addr));
+
+    return status;
+}
+
+/* Feed the CRC unit with DMA1 channel 1 (memory to memory) instead of
+   word by word from the CPU */
+#if !defined(FLASH_CRC_DMA)
+#define FLASH_CRC_DMA            1
+#endif
+
+#define FLASH_CRC_DMA_MAX        0xffff         /* Words per DMA transfer */
+
+/*
+ * CRC-32 of the CRC unit over whole words: polynomial 0x04c11db7, initial
+ * value 0xffffffff, no reflection and no final xor.
+ */
+static uint32_t flashCrc32(uint32_t addr, uint32_t words) {
+    const uint32_t *p = (const uint32_t *)addr;
+    uint32_t crc;
+
+    rccEnableCRC(FALSE);
+    CRC->CR = CRC_CR_RESET;
+
+#if FLASH_CRC_DMA
+    const stm32_dma_stream_t *dma = STM32_DMA1_STREAM1;
+
+    // Word by word below if the channel is taken
+    if (!dmaStreamAllocate(dma, 0, NULL, NULL)) {
+        dmaStreamSetMemory0(dma, &CRC->DR);
+        while (words > 0) {
+            uint32_t count = MIN(words, FLASH_CRC_DMA_MAX);
+
+            /* The flash is the "peripheral" side, the only one incremented */
+            dmaStreamSetPeripheral(dma, p);
+            dmaStreamSetTransactionSize(dma, count);
+            dmaStreamSetMode(dma, STM32_DMA_CR_DIR_M2M | STM32_DMA_CR_PINC |
+                                  STM32_DMA_CR_PSIZE_WORD | STM32_DMA_CR_MSIZE_WORD);
+            dmaStreamEnable(dma);
+
+            /* A few cycles a word, the flash is the only other bus user */
+            dmaWaitCompletion(dma);
+
+            p     += count;
+            words -= count;
+        }
+        dmaStreamRelease(dma);
+    }
+#endif
+
+    while (words-- > 0) {
+        CRC->DR = *p++;
+    }
+
+    crc = CRC->DR;
+    rccDisableCRC(FALSE);
+
+    return crc;
 }
 
 /*===========================================================================*/
@@ -89,13 +319,640 @@ static bool flashWriteWord(uint32_t addr, uint32_t word) {
 #define DFU_STATE_BZY            0x10
 #define DFU_STATE_ERR            0x20
 
-uint8_t dfu_state = DFU_STATE_RDY;
-uint8_t dfu_command[16 + 1024];
+#define DFU_CHUNK_SIZE           1024
+
+/* Compare each chunk with the flash: the erase requested by 0x41 is held
+   back until the data shows up and only done when the data needs it */
+#if !defined(DFU_INCREMENTAL)
+#define DFU_INCREMENTAL          1
+#endif
+
+/* Number of chunk buffers: the next chunks are received while the worker
+   decrypts and programs the current one */
+#if !defined(DFU_CHUNK_NUM)
+#define DFU_CHUNK_NUM            3
+#endif
+
+/* Update debug log on SD2, deferred to the bdlog thread so that it leaves
+   the update timing alone */
+#if !defined(DFU_DEBUG)
+#define DFU_DEBUG                0
+#endif
+
+#if DFU_DEBUG
+#define DFU_LOG(...)             bdlog(__VA_ARGS__)
+#else
+#define DFU_LOG(...)             do { } while (0)
+#endif
+
+/* Word aligned so the payload at command + 16 takes the aligned AES path */
+typedef struct {
+    uint8_t command[16 + DFU_CHUNK_SIZE] __attribute__((aligned(4)));
+} dfu_chunk_t;
+
+/* Pages that already held their data, pages programmed without an erase */
+static uint16_t dfu_pages_skipped = 0;
+static uint16_t dfu_pages_noerase = 0;
+
+/* Data chunk bytes as received and once decompressed */
+static uint32_t dfu_bytes_wire = 0;
+static uint32_t dfu_bytes_image = 0;
+/* Pages a range erase still has to go through, written by the worker only */
+static uint16_t dfu_erase_left = 0;
+
+/* Pages of a range erase not done yet, the worker erases them when no
+   chunk is queued, those just past the write cursor first. It spares the
+   range erase request a wait of 20 ms per page; the erase itself does not
+   overlap anything, every fetch stalls while the flash is busy */
+#define DFU_ERASE_MAP_PAGES      256
+static uint32_t dfu_erase_map[DFU_ERASE_MAP_PAGES / 32];
+#if DFU_INCREMENTAL
+/* Pages a range erase went through, programming them needs no erase */
+static uint32_t dfu_erase_done[DFU_ERASE_MAP_PAGES / 32];
+#endif
+static uint32_t dfu_erase_cursor = FLASH_APP_BASE;
+
+#if DFU_INCREMENTAL
+/* Page of the held back erase, 0 if none */
+static uint32_t dfu_erase_page = 0;
+static bool dfuFlushErase(void);
+#endif
+/* Worker jobs, each kind is timed with the cycle counter so the status
+   reply can tell the host when the worker is done with the current one */
+#define DFU_JOB_CMD              0
+#define DFU_JOB_DATA             1
+#define DFU_JOB_ERASE            2
+#define DFU_JOB_NUM              3
+#define DFU_JOB_NONE             0xff
+
+/*
+ * State shared by DfuCmd and DfuWorker, packed in one word so that every
+ * transition is a single LDREX/STREX compare and swap and every reader
+ * works on a consistent snapshot:
+ * - bits  0..7:  DFU state
+ * - bits  8..15: bStatus reported in DFU_STATE_ART or DFU_STATE_ERR
+ * - bits 16..23: chunks handed to the worker and not yet done with
+ * - bits 24..31: job the worker is on
+ */
+#define DFU_SYNC(state, status, pending, job) \
+    ((uint32_t)(state) | (uint32_t)(status) << 8 | (uint32_t)(pending) << 16 | (uint32_t)(job) << 24)
+#define DFU_SYNC_STATE(v)        ((uint8_t)((v) >>  0))
+#define DFU_SYNC_STATUS(v)       ((uint8_t)((v) >>  8))
+#define DFU_SYNC_PENDING(v)      ((uint8_t)((v) >> 16))
+#define DFU_SYNC_JOB(v)          ((uint8_t)((v) >> 24))
+
+static uint32_t dfu_sync = DFU_SYNC(DFU_STATE_RDY, DFU_STATUS_OK, 0, DFU_JOB_NONE);
+
+static uint32_t dfuSyncLoad(void) {
+    return __atomic_load_n(&dfu_sync, __ATOMIC_ACQUIRE);
+}
+
+/* On failure *v is reloaded, the caller recomputes and tries again */
+static bool dfuSyncSwap(uint32_t *v, uint32_t next) {
+    return __atomic_compare_exchange_n(&dfu_sync, v, next, TRUE, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE);
+}
+
+/* Replace the fields under mask, returns the previous snapshot */
+static uint32_t dfuSyncSet(uint32_t mask, uint32_t bits) {
+    uint32_t v = dfuSyncLoad();
+
+    while (!dfuSyncSwap(&v, (v & ~mask) | bits)) {}
+
+    return v;
+}
+
+static bool dfuSyncFailed(uint32_t v) {
+    return (DFU_SYNC_STATE(v) & (DFU_STATE_ART | DFU_STATE_ERR)) != 0;
+}
+
+static dfu_chunk_t dfu_chunks[DFU_CHUNK_NUM];
+static MEMORYPOOL_DECL(dfu_chunk_pool, sizeof(dfu_chunk_t), NULL);
+static SEMAPHORE_DECL(dfu_chunk_sem, DFU_CHUNK_NUM);
+
+static msg_t dfu_chunk_mb_buf[DFU_CHUNK_NUM];
+static MAILBOX_DECL(dfu_chunk_mb, dfu_chunk_mb_buf, DFU_CHUNK_NUM);
 
-static SEMAPHORE_DECL(dfu_cmd_sem, 0);
 static SEMAPHORE_DECL(dfu_cmd_sem_action, 0);
-static MUTEX_DECL(dfu_cmd_mtx);
 
+/* Running average duration in us, seeded with the datasheet times */
+static uint32_t dfu_job_us[DFU_JOB_NUM] = { 100, 30000, 20000 };
+/* Start of the current job, written before the job is published */
+static volatile rtcnt_t dfu_job_start;
+static uint8_t dfu_job_current = DFU_JOB_NONE;
+
+static void dfuJobBegin(uint8_t job) {
+    dfu_job_start = chSysGetRealtimeCounterX();
+    dfu_job_current = job;
+    dfuSyncSet(DFU_SYNC(0, 0, 0, 0xff), DFU_SYNC(0, 0, 0, job));
+}
+
+static void dfuJobEnd(void) {
+    uint32_t us = RTC2US(STM32_HCLK, chSysGetRealtimeCounterX() - dfu_job_start);
+
+    dfuSyncSet(DFU_SYNC(0, 0, 0, 0xff), DFU_SYNC(0, 0, 0, DFU_JOB_NONE));
+    dfu_job_us[dfu_job_current] = (dfu_job_us[dfu_job_current] * 3 + us) / 4;
+}
+
+/*
+ * Poll timeout in ms for the status reply from the snapshot v. Chunks are
+ * taken as long as a buffer is free, otherwise the host has to wait for
+ * the worker to finish its current job (and the chunk after it when that
+ * job is a look-ahead erase).
+ */
+static uint32_t dfuPollTimeout(uint32_t v) {
+    uint8_t job = DFU_SYNC_JOB(v);
+    uint32_t spent, left;
+
+    if (DFU_SYNC_PENDING(v) < DFU_CHUNK_NUM || job == DFU_JOB_NONE) {
+        return 0;
+    }
+
+    spent = RTC2US(STM32_HCLK, chSysGetRealtimeCounterX() - dfu_job_start);
+    left = spent < dfu_job_us[job] ? dfu_job_us[job] - spent : 0;
+    if (job == DFU_JOB_ERASE) {
+        left += dfu_job_us[DFU_JOB_DATA];
+    }
+
+    return (left + 999) / 1000;
+}
+
+
+/*
+ * Vendor commands, each gets the 16 bytes command block and a scratch
+ * buffer for its reply.
+ */
+static void dfuCmdGetVersion(uint8_t *rxbuf, uint8_t *txbuf) {
+    volatile uint8_t *p = (volatile uint8_t *)(FLASH_BASE + 16 * 1024 - 2);
+
+    (void)rxbuf;
+
+    txbuf[0] = p[0];
+    txbuf[1] = p[1];
+
+    // Fill with VID
+    txbuf[2] = (BDLINK_VID >> 0) & 0xff;
+    txbuf[3] = (BDLINK_VID >> 8) & 0xff;
+    // Fill with PID
+    txbuf[4] = (BDLINK_PID >> 0) & 0xff;
+    txbuf[5] = (BDLINK_PID >> 8) & 0xff;
+
+    usbTransmit(&USBD1, USBD1_STLINK_TX_EP, txbuf, 6);
+}
+
+static void dfuCmdGetMode(uint8_t *rxbuf, uint8_t *txbuf) {
+    (void)rxbuf;
+
+    txbuf[0] = 0x00;
+    txbuf[1] = 0x02;
+
+    usbTransmit(&USBD1, USBD1_STLINK_TX_EP, txbuf, 2);
+}
+
+static void dfuCmdGetId(uint8_t *rxbuf, uint8_t *txbuf) {
+    volatile uint32_t *p;
+
+    (void)rxbuf;
+
+    txbuf[0] = 0x80; txbuf[1] = 0x00; txbuf[2] = 0xff; txbuf[3] = 0xff;
+
+    // blank configure area: 06 40 05 49
+    // stm32 only:           4a 06 40 05
+    // stm32 msd + vcp:      42 06 40 05
+    txbuf[4] = 0x42; txbuf[5] = 0x06; txbuf[6] = 0x40; txbuf[7] = 0x05;
+
+    p = (volatile uint32_t *)0x1FFFF7E8;
+    *(uint32_t *)(txbuf +  8) = p[0];
+    *(uint32_t *)(txbuf + 12) = p[1];
+    *(uint32_t *)(txbuf + 16) = p[2];
+
+    usbTransmit(&USBD1, USBD1_STLINK_TX_EP, txbuf, 20);
+}
+
+static void dfuCmdGetBoard(uint8_t *rxbuf, uint8_t *txbuf) {
+    (void)rxbuf;
+
+    memset(txbuf, 0x00, 16);
+    // For ST-LINK/V2 or ST-LINK/V2-1:
+    // - PC13 Pull down with 10K Resistor
+    // - PC14 Floating
+    if (palReadPad(GPIOC, 13) == 0 && palReadPad(GPIOC, 14) == 1) {
+        txbuf[3] = 0x21;
+    }
+
+    usbTransmit(&USBD1, USBD1_STLINK_TX_EP, txbuf, 16);
+}
+
+/* Lets the worker finish the queued chunks and the range erase, the flash
+   is as the host asked for it afterwards */
+static void dfuDrain(void) {
+    while (DFU_SYNC_PENDING(dfuSyncLoad()) != 0 || __atomic_load_n(&dfu_erase_left, __ATOMIC_ACQUIRE) != 0) {
+        chThdSleepMilliseconds(1);
+    }
+#if DFU_INCREMENTAL
+    // Nothing came for the last erased page, a failure is reported as
+    // any chunk's would be
+    if (!dfuFlushErase()) {
+        dfuSyncSet(DFU_SYNC(0xff, 0xff, 0, 0), DFU_SYNC(DFU_STATE_ART, DFU_STATUS_ERR_ERASE, 0, 0));
+    }
+#endif
+}
+
+/* DfuCmd only: the host saw the last chunk idle, it saw the latched
+   failure */
+static bool dfu_idle_seen = FALSE;
+static bool dfu_failure_seen = FALSE;
+
+/* Back to dfuIDLE after a USB reset or a cut short transfer. A latched
+   failure stays until the worker has dropped the chunks queued behind it,
+   it would commit them otherwise */
+static void dfuAbort(void) {
+    while (DFU_SYNC_PENDING(dfuSyncLoad()) != 0) {
+        chThdSleepMilliseconds(1);
+    }
+    dfuSyncSet(DFU_SYNC(0xff, 0, 0, 0), DFU_SYNC(DFU_STATE_RDY, 0, 0, 0));
+
+    dfu_idle_seen = FALSE;
+    dfu_failure_seen = FALSE;
+}
+
+static void dfuCmdGetStatus(uint8_t *rxbuf, uint8_t *txbuf) {
+    rtcnt_t start = chSysGetRealtimeCounterX();
+    uint32_t v = dfuSyncLoad();
+    uint8_t size = 6;
+
+    /* Asked again once the last chunk was idle: the host is done with
+       downloading, the reply waits for the queued chunks to tell how
+       they went */
+    if (dfu_idle_seen && DFU_SYNC_PENDING(v) != 0) {
+        dfuDrain();
+        v = dfuSyncLoad();
+    }
+
+    /* Busy is reported once per chunk, the snapshot that cleared it is
+       the one replied from */
+    while (DFU_SYNC_STATE(v) == (DFU_STATE_STP | DFU_STATE_BZY) &&
+            !dfuSyncSwap(&v, v & ~(uint32_t)DFU_STATE_BZY)) {}
+
+    switch (DFU_SYNC_STATE(v)) {
+    case DFU_STATE_RDY:
+        memcpy(txbuf, "\x00\x00\x00\x00\x02\x00", 6);
+        break;
+    case DFU_STATE_STP | DFU_STATE_BZY:
+    case DFU_STATE_RUN: {
+        uint32_t timeout = dfuPollTimeout(v);
+
+        memcpy(txbuf, "\x00\x00\x00\x00\x04\x00", 6);
+        txbuf[1] = (timeout >>  0) & 0xff;
+        txbuf[2] = (timeout >>  8) & 0xff;
+        txbuf[3] = (timeout >> 16) & 0xff;
+        break;
+    }
+    case DFU_STATE_STP:
+        memcpy(txbuf, "\x00\x00\x00\x00\x05\x00", 6);
+        dfu_idle_seen = TRUE;
+        break;
+    default: // DFU_STATE_ART, DFU_STATE_ERR: dfuERROR, the host gives up
+        memcpy(txbuf, "\x00\x00\x00\x00\x0a\x00", 6);
+        txbuf[0] = DFU_SYNC_STATUS(v);
+        dfu_failure_seen = TRUE;
+        break;
+    }
+
+    /* A host asking for 10 bytes also gets the skipped and the
+       programmed without erase page counts, 12 bytes adds the pages
+       left in a range erase, 20 bytes the data bytes received and
+       programmed */
+    if (rxbuf[6] >= 10) {
+        uint16_t erase_left = __atomic_load_n(&dfu_erase_left, __ATOMIC_RELAXED);
+
+        size = rxbuf[6] >= 20 ? 20 : rxbuf[6] >= 12 ? 12 : 10;
+
+        txbuf[6] = (dfu_pages_skipped >> 0) & 0xff;
+        txbuf[7] = (dfu_pages_skipped >> 8) & 0xff;
+        txbuf[8] = (dfu_pages_noerase >> 0) & 0xff;
+        txbuf[9] = (dfu_pages_noerase >> 8) & 0xff;
+        txbuf[10] = (erase_left >> 0) & 0xff;
+        txbuf[11] = (erase_left >> 8) & 0xff;
+        memcpy(txbuf + 12, &dfu_bytes_wire, 4);
+        memcpy(txbuf + 16, &dfu_bytes_image, 4);
+    }
+
+    /* The reply itself goes at the host's pace */
+    dfuProfSince(DFU_PROF_STATUS, start);
+
+    usbTransmit(&USBD1, USBD1_STLINK_TX_EP, txbuf, size);
+}
+
+static void dfuCmdDownload(uint8_t *rxbuf, uint8_t *txbuf) {
+    uint16_t len = rxbuf[6] | rxbuf[7] << 8;
+    dfu_chunk_t *chunk = NULL;
+    uint8_t *p;
+    uint16_t size;
+    uint32_t v, next;
+    rtcnt_t start;
+    msg_t msg;
+
+    (void)txbuf;
+
+    if (len <= DFU_CHUNK_SIZE) {
+        /* Wait for a free chunk buffer, the host is NAKed meanwhile */
+        chSemWait(&dfu_chunk_sem);
+        chunk   = (dfu_chunk_t *)chPoolAlloc(&dfu_chunk_pool);
+        memcpy(chunk->command, rxbuf, 16);
+        p       = chunk->command + 16;
+        size    = DFU_CHUNK_SIZE;
+    } else {
+        dfuSyncSet(DFU_SYNC(0xff, 0xff, 0, 0), DFU_SYNC(DFU_STATE_ERR, DFU_STATUS_ERR_UNKNOWN, 0, 0));
+
+        p       = rxbuf;
+        size    = 16;
+    }
+    start = chSysGetRealtimeCounterX();
+    do {
+        msg = usbReceive(&USBD1, USBD1_STLINK_RX_EP, p, MIN(size, len));
+        if (msg <= 0) {
+            break;
+        }
+
+        if (chunk != NULL) p += msg;
+        len     -= (uint16_t)msg;
+    } while (len > 0);
+    dfuProfSince(DFU_PROF_USB_PAYLOAD, start);
+
+    if (chunk == NULL) return;
+
+    if (len > 0) {
+        chPoolFree(&dfu_chunk_pool, chunk);
+        chSemSignal(&dfu_chunk_sem);
+
+        dfuAbort();
+        return;
+    }
+
+    dfuTrace(DFU_TRACE_CHUNK, 0, chunk->command[2] | chunk->command[3] << 8);
+
+    /* The chunk is accepted as soon as it is queued. A failure is kept
+       until the queued chunks are drained and the host was told about it,
+       then the download starts over */
+    v = dfuSyncLoad();
+    do {
+        next = v + DFU_SYNC(0, 0, 1, 0);
+        if (!dfuSyncFailed(v) || (DFU_SYNC_PENDING(v) == 0 && dfu_failure_seen)) {
+            next = (next & ~(uint32_t)0xff) | (DFU_STATE_STP | DFU_STATE_BZY);
+        }
+    } while (!dfuSyncSwap(&v, next));
+    dfu_idle_seen = FALSE;
+    if (!dfuSyncFailed(next)) {
+        dfu_failure_seen = FALSE;
+    }
+
+    chMBPost(&dfu_chunk_mb, (msg_t)chunk, TIME_INFINITE);
+}
+
+static void dfuCmdReadConfig(uint8_t *rxbuf, uint8_t *txbuf) {
+    const uint8_t *p = (const uint8_t *)(FLASH_BASE + 15 * 1024 + 0x30);
+    uint8_t len = rxbuf[2];
+
+    (void)txbuf;
+
+    /* Straight from the flash, up to 255 bytes would not fit in txbuf */
+    usbTransmit(&USBD1, USBD1_STLINK_TX_EP, p, len);
+}
+
+static void dfuCmdExit(uint8_t *rxbuf, uint8_t *txbuf) {
+    uint32_t v = dfuSyncLoad();
+
+    (void)rxbuf;
+    (void)txbuf;
+
+    // Never into a half written application, the status tells why
+    if (dfuSyncFailed(v)) {
+        DFU_LOG("dfu: exit refused, status %u\r\n", DFU_SYNC_STATUS(v));
+        return;
+    }
+
+    DFU_LOG("dfu: exit, %u pages skipped, %u programmed without erase\r\n",
+            dfu_pages_skipped, dfu_pages_noerase);
+
+    // Exit DFU mode
+    usbDisconnectBus(&USBD1);
+    chThdSleepMilliseconds(1500);
+
+    BKP->DR1 = 0xfeed;
+
+    NVIC_SystemReset();
+}
+
+/*
+ * 0xf3 0x81: raw bulk OUT throughput. The little endian byte count at 2..5
+ * is received into a chunk buffer and thrown away, the reply is the byte
+ * count taken and the time it took in us.
+ */
+static void dfuCmdBulkSink(uint8_t *rxbuf, uint8_t *txbuf) {
+    uint32_t len = rxbuf[2] | rxbuf[3] << 8 | rxbuf[4] << 16 | (uint32_t)rxbuf[5] << 24;
+    uint32_t done = 0, us;
+    dfu_chunk_t *chunk;
+    rtcnt_t start;
+    msg_t msg;
+
+    chSemWait(&dfu_chunk_sem);
+    chunk = (dfu_chunk_t *)chPoolAlloc(&dfu_chunk_pool);
+
+    start = chSysGetRealtimeCounterX();
+    while (done < len) {
+        msg = usbReceive(&USBD1, USBD1_STLINK_RX_EP, chunk->command, MIN(len - done, DFU_CHUNK_SIZE));
+        if (msg <= 0) {
+            break;
+        }
+        done += (uint32_t)msg;
+    }
+    us = RTC2US(STM32_HCLK, chSysGetRealtimeCounterX() - start);
+
+    chPoolFree(&dfu_chunk_pool, chunk);
+    chSemSignal(&dfu_chunk_sem);
+
+    memcpy(txbuf + 0, &done, 4);
+    memcpy(txbuf + 4, &us, 4);
+    usbTransmit(&USBD1, USBD1_STLINK_TX_EP, txbuf, 8);
+}
+
+/*
+ * 0xf3 0x82: update path profile, 4 bytes header (stage count, 0, cycles
+ * per us) followed by 20 bytes per stage: min, max, 64-bit sum and count
+ * in cycles. Bit 0 of byte 2 clears the profile once it is read.
+ */
+static void dfuCmdGetProfile(uint8_t *rxbuf, uint8_t *txbuf) {
+    uint8_t reply[4 + 20 * DFU_PROF_NUM];
+    uint16_t mhz = STM32_HCLK / 1000000;
+    uint8_t *p = reply + 4;
+    uint32_t idx;
+
+    (void)txbuf;
+
+    reply[0] = DFU_PROF_NUM;
+    reply[1] = 0;
+    memcpy(reply + 2, &mhz, 2);
+
+    chSysLock();
+    for (idx = 0; idx < DFU_PROF_NUM; idx++, p += 20) {
+        memcpy(p +  0, &dfu_prof[idx].min, 4);
+        memcpy(p +  4, &dfu_prof[idx].max, 4);
+        memcpy(p +  8, &dfu_prof[idx].sum, 8);
+        memcpy(p + 16, &dfu_prof[idx].count, 4);
+    }
+    if (rxbuf[2] & 0x01) {
+        memset(dfu_prof, 0x00, sizeof(dfu_prof));
+    }
+    chSysUnlock();
+
+    usbTransmit(&USBD1, USBD1_STLINK_TX_EP, reply, sizeof(reply));
+}
+
+/*
+ * 0xf3 0x83: CRC-32 of the flash, word aligned little endian address at
+ * 2..5 and byte count at 6..9 (a multiple of 4). Answered once the queued
+ * chunks are programmed: CRC and bStatus, 3 bytes reserved. Only the
+ * application area: the CRC of a single word gives the word away.
+ */
+static void dfuCmdGetCrc(uint8_t *rxbuf, uint8_t *txbuf) {
+    uint32_t addr = rxbuf[2] | rxbuf[3] << 8 | rxbuf[4] << 16 | (uint32_t)rxbuf[5] << 24;
+    uint32_t len = rxbuf[6] | rxbuf[7] << 8 | rxbuf[8] << 16 | (uint32_t)rxbuf[9] << 24;
+    uint32_t crc = 0;
+    uint8_t status = DFU_STATUS_OK;
+
+    if (addr < FLASH_APP_BASE || addr > flashEnd() || len > flashEnd() - addr || ((addr | len) & 3) != 0) {
+        status = DFU_STATUS_ERR_ADDRESS;
+    } else {
+        crc = flashCrc32(addr, len / 4);
+    }
+
+    memset(txbuf, 0x00, 8);
+    memcpy(txbuf, &crc, 4);
+    txbuf[4] = status;
+    usbTransmit(&USBD1, USBD1_STLINK_TX_EP, txbuf, 8);
+}
+
+/*
+ * 0xf3 0x84: flash readback, little endian address at 2..5 and byte count
+ * at 6..9 (at most the flash size). The bytes go out back to back in 64
+ * bytes packets straight from the flash. Everything outside the
+ * application area, the bootloader included, reads as 0xff.
+ */
+static void dfuCmdUpload(uint8_t *rxbuf, uint8_t *txbuf) {
+    static uint8_t packet[64];
+    uint32_t addr = rxbuf[2] | rxbuf[3] << 8 | rxbuf[4] << 16 | (uint32_t)rxbuf[5] << 24;
+    uint32_t len = rxbuf[6] | rxbuf[7] << 8 | rxbuf[8] << 16 | (uint32_t)rxbuf[9] << 24;
+    uint32_t end = flashEnd(), piece, idx;
+    msg_t msg;
+
+    (void)txbuf;
+
+    len = MIN(len, end - FLASH_BASE);
+
+    while (len > 0) {
+        if (addr >= FLASH_APP_BASE && addr < end && end - addr >= MIN(len, sizeof(packet))) {
+            /* Whole packets, only the last transfer may end short */
+            piece = len <= end - addr ? len : (end - addr) & ~(uint32_t)(sizeof(packet) - 1);
+            msg = usbTransmit(&USBD1, USBD1_STLINK_TX_EP, (const uint8_t *)addr, piece);
+        } else {
+            piece = MIN(len, sizeof(packet));
+            for (idx = 0; idx < piece; idx++) {
+                uint32_t a = addr + idx;
+
+                packet[idx] = a >= FLASH_APP_BASE && a < end ? *(const uint8_t *)a : 0xff;
+            }
+            msg = usbTransmit(&USBD1, USBD1_STLINK_TX_EP, packet, piece);
+        }
+        if (msg != MSG_OK) {
+            break;
+        }
+
+        addr += piece;
+        len  -= piece;
+    }
+}
+
+static void dfuCmdGetStats(uint8_t *rxbuf, uint8_t *txbuf);
+
+typedef struct {
+    uint8_t key[3];             /* Leading command bytes to match */
+    uint8_t keylen;
+    uint8_t zero_end;           /* Bytes from keylen up to here must be 0 */
+    void (*handler)(uint8_t *rxbuf, uint8_t *txbuf);
+} dfu_cmd_t;
+
+/* Most frequent first, a lookup mostly compares the first two bytes */
+static const dfu_cmd_t dfu_cmds[] = {
+    { { 0xf3, 0x01, 0x00 }, 2,  2, dfuCmdDownload   },
+    { { 0xf3, 0x03, 0x00 }, 2,  4, dfuCmdGetStatus  },
+    { { 0xf1, 0x80, 0x00 }, 2, 16, dfuCmdGetVersion },
+    { { 0xf5, 0x00, 0x00 }, 2, 16, dfuCmdGetMode    },
+    { { 0xf3, 0x08, 0x00 }, 2, 16, dfuCmdGetId      },
+    { { 0xf3, 0x0a, 0x00 }, 2, 16, dfuCmdGetBoard   },
+    { { 0xf3, 0x09, 0x16 }, 3, 16, dfuCmdReadConfig },
+    { { 0xf3, 0x07, 0x00 }, 2,  4, dfuCmdExit       },
+    { { 0xf3, 0x80, 0x00 }, 2, 16, dfuCmdGetStats   },
+    { { 0xf3, 0x81, 0x00 }, 2,  2, dfuCmdBulkSink   },
+    { { 0xf3, 0x82, 0x00 }, 2,  2, dfuCmdGetProfile },
+    { { 0xf3, 0x83, 0x00 }, 2,  2, dfuCmdGetCrc     },
+    { { 0xf3, 0x84, 0x00 }, 2,  2, dfuCmdUpload     },
+};
+
+#define DFU_CMD_NUM              (sizeof(dfu_cmds) / sizeof(dfu_cmds[0]))
+
+/* Hits and handling time in us per table entry, plus commands nobody
+   took: unknown, or with bad arguments */
+static uint32_t dfu_cmd_hits[DFU_CMD_NUM];
+static uint32_t dfu_cmd_us[DFU_CMD_NUM];
+static uint32_t dfu_cmd_unknown = 0;
+
+/*
+ * 0xf3 0x80: command statistics, 8 bytes header (entry count, 3 reserved,
+ * unknown commands) followed by 10 bytes per entry: the two opcode bytes,
+ * hits and total handling time in us.
+ */
+static void dfuCmdGetStats(uint8_t *rxbuf, uint8_t *txbuf) {
+    uint8_t reply[8 + 10 * DFU_CMD_NUM];
+    uint8_t *p = reply + 8;
+    uint32_t idx;
+
+    (void)rxbuf;
+    (void)txbuf;
+
+    memset(reply, 0x00, 8);
+    reply[0] = DFU_CMD_NUM;
+    memcpy(reply + 4, &dfu_cmd_unknown, 4);
+    for (idx = 0; idx < DFU_CMD_NUM; idx++, p += 10) {
+        p[0] = dfu_cmds[idx].key[0];
+        p[1] = dfu_cmds[idx].key[1];
+        memcpy(p + 2, &dfu_cmd_hits[idx], 4);
+        memcpy(p + 6, &dfu_cmd_us[idx], 4);
+    }
+
+    usbTransmit(&USBD1, USBD1_STLINK_TX_EP, reply, sizeof(reply));
+}
+
+static const dfu_cmd_t *dfuCmdLookup(const uint8_t *rxbuf) {
+    uint32_t idx, pos;
+
+    for (idx = 0; idx < DFU_CMD_NUM; idx++) {
+        const dfu_cmd_t *cmd = &dfu_cmds[idx];
+
+        if (memcmp(rxbuf, cmd->key, cmd->keylen) != 0) {
+            continue;
+        }
+
+        for (pos = cmd->keylen; pos < cmd->zero_end; pos++) {
+            if (rxbuf[pos] != 0x00) {
+                return NULL;
+            }
+        }
+
+        return cmd;
+    }
+
+    return NULL;
+}
 
 static THD_WORKING_AREA(waDfuCmd, 2048);
 static __attribute__((noreturn)) THD_FUNCTION(DfuCmd, arg) {
@@ -104,235 +961,636 @@ static __attribute__((noreturn)) THD_FUNCTION(DfuCmd, arg) {
 
   chRegSetThreadName("DfuCmd");
   while (true) {
+    const dfu_cmd_t *cmd;
+    rtcnt_t start = chSysGetRealtimeCounterX();
     msg_t msg = usbReceive(&USBD1, USBD1_STLINK_RX_EP, rxbuf, sizeof(rxbuf));
+    dfuProfSince(DFU_PROF_USB_HEADER, start);
     if (msg == MSG_RESET) {
+        dfuTrace(DFU_TRACE_USB_RESET, 0, 0);
+        DFU_LOG("dfu: usb reset\r\n");
         chThdSleepMilliseconds(500);
-        chMtxLock(&dfu_cmd_mtx);
-        dfu_state = DFU_STATE_RDY;
-        chMtxUnlock(&dfu_cmd_mtx);
+        dfuAbort();
         continue;
     }
 
     /* Notify blink thread in data transmition */
     chSemSignal(&dfu_cmd_sem_action);
 
-    if (!memcmp(rxbuf, "\xf1\x80\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00", 16)) {
-        volatile uint8_t *p = (volatile uint8_t *)(FLASH_BASE + 16 * 1024 - 2);
-
-        txbuf[0] = p[0];
-        txbuf[1] = p[1];
-
-        // Fill with VID
-        txbuf[2] = (BDLINK_VID >> 0) & 0xff;
-        txbuf[3] = (BDLINK_VID >> 8) & 0xff;
-        // Fill with PID
-        txbuf[4] = (BDLINK_PID >> 0) & 0xff;
-        txbuf[5] = (BDLINK_PID >> 8) & 0xff;
-
-        usbTransmit(&USBD1, USBD1_STLINK_TX_EP, txbuf, 6);
-    } else if (!memcmp(rxbuf, "\xf5\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00", 16)) {
-        txbuf[0] = 0x00;
-        txbuf[1] = 0x02;
-
-        usbTransmit(&USBD1, USBD1_STLINK_TX_EP, txbuf, 2);
-    } else if (!memcmp(rxbuf, "\xf3\x08\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00", 16)) {
-        volatile uint32_t *p;
-
-        txbuf[0] = 0x80; txbuf[1] = 0x00; txbuf[2] = 0xff; txbuf[3] = 0xff;
-
-        // blank configure area: 06 40 05 49
-        // stm32 only:           4a 06 40 05
-        // stm32 msd + vcp:      42 06 40 05
-        txbuf[4] = 0x42; txbuf[5] = 0x06; txbuf[6] = 0x40; txbuf[7] = 0x05;
-
-        p = (volatile uint32_t *)0x1FFFF7E8;
-        *(uint32_t *)(txbuf +  8) = p[0];
-        *(uint32_t *)(txbuf + 12) = p[1];
-        *(uint32_t *)(txbuf + 16) = p[2];
-
-        usbTransmit(&USBD1, USBD1_STLINK_TX_EP, txbuf, 20);
-    } else if (!memcmp(rxbuf, "\xf3\x0a\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00", 16)) {
-        memset(txbuf, 0x00, 16);
-        // For ST-LINK/V2 or ST-LINK/V2-1:
-        // - PC13 Pull down with 10K Resistor
-        // - PC14 Floating
-        if (palReadPad(GPIOC, 13) == 0 && palReadPad(GPIOC, 14) == 1) {
-            txbuf[3] = 0x21;
+    /* Command blocks are always 16 bytes */
+    cmd = msg == 16 ? dfuCmdLookup(rxbuf) : NULL;
+    if (cmd == NULL) {
+        dfu_cmd_unknown++;
+        continue;
+    }
+
+    /* Only the next download overtakes the queued chunks, anything else
+       sees the flash and the status as they end up */
+    if (cmd->handler != dfuCmdDownload && cmd->handler != dfuCmdGetStatus) {
+        dfuDrain();
+    }
+
+    start = chSysGetRealtimeCounterX();
+    cmd->handler(rxbuf, txbuf);
+    dfu_cmd_hits[cmd - dfu_cmds]++;
+    dfu_cmd_us[cmd - dfu_cmds] += RTC2US(STM32_HCLK, chSysGetRealtimeCounterX() - start);
+  }
+}
+
+/*
+ * The decryption key only depends on the device UID: derive it on the first
+ * encrypted chunk and keep it for the rest of the session.
+ */
+static const AES_KEY *dfuSessionKey(void) {
+    static AES_KEY aes_key;
+    static bool ready = FALSE;
+
+    if (!ready) {
+        rtcnt_t start = chSysGetRealtimeCounterX();
+        const uint8_t salt[] = {
+            0x29, 0xf1, 0x95, 0x64, 0xcc, 0xdb, 0xde, 0xf9,
+            0x3b, 0xd1, 0xe7, 0x7d, 0x8a, 0x89, 0xb9, 0xbf
+        };
+        uint8_t devuid[16] = {
+            0x80, 0x00, 0xff, 0xff,
+            'b', 'r', 'o', 'b',
+            'w', 'i', 'n', 'd',
+            '.', 'c', 'o', 'm'
+        };
+
+        uint8_t deckey[16];
+
+        AES_set_decrypt_key(devuid, 128, &aes_key);
+        AES_decrypt(salt, deckey, &aes_key);
+
+        AES_set_encrypt_key(deckey, 128, &aes_key);
+        memcpy(devuid + 4, (void *)0x1FFFF7E8, 12);
+        AES_encrypt(devuid, deckey, &aes_key);
+        AES_set_decrypt_key(deckey, 128, &aes_key);
+
+        ready = TRUE;
+        dfuProfSince(DFU_PROF_KEY, start);
+    }
+
+    return &aes_key;
+}
+
+/* Byte sum of word aligned data, one byte column per 16-bit lane: no overflow up to 1 KB */
+static uint16_t dfuChecksum(const uint8_t *data, uint16_t len) {
+    const uint32_t *word = (const uint32_t *)data;
+    uint32_t even = 0, odd = 0, sum;
+    uint16_t idx;
+
+    for (idx = 0; idx + 4 <= len; idx += 4, word++) {
+        even += *word & 0x00ff00ff;
+        odd  += (*word >> 8) & 0x00ff00ff;
+    }
+    sum = (even & 0xffff) + (even >> 16) + (odd & 0xffff) + (odd >> 16);
+
+    for (; idx < len; idx++) {
+        sum += data[idx];
+    }
+
+    return sum;
+}
+
+/* Decrypt in place in one run over the blocks, then sum the plain text */
+static uint16_t dfuDecryptChunk(uint8_t *data, uint16_t len) {
+    const AES_KEY *aes_key = dfuSessionKey();
+    rtcnt_t start = chSysGetRealtimeCounterX();
+    uint16_t sum;
+
+    AES_decrypt_blocks(data, data, (len + 15) / 16, aes_key);
+    dfuProfSince(DFU_PROF_DECRYPT, start);
+
+    start = chSysGetRealtimeCounterX();
+    sum = dfuChecksum(data, len);
+    dfuProfSince(DFU_PROF_CHECKSUM, start);
+
+    return sum;
+}
+
+#if DFU_INCREMENTAL
+/* True unless every half-word is equal, blank or goes to 0x0000 */
+static bool dfuNeedsErase(uint32_t addr, const uint8_t *data, uint32_t len) {
+    const uint16_t *old = (const uint16_t *)addr;
+    const uint16_t *new = (const uint16_t *)data;
+    uint32_t idx;
+
+    for (idx = 0; idx < len / 2; idx++) {
+        if (old[idx] != new[idx] && old[idx] != 0xffff && new[idx] != 0x0000) {
+            return TRUE;
         }
+    }
 
-        usbTransmit(&USBD1, USBD1_STLINK_TX_EP, txbuf, 16);
-    } else if (!memcmp(rxbuf, "\xf3\x03\x00\x00", 4) && msg == 16) {
-        chMtxLock(&dfu_cmd_mtx);
-        switch (dfu_state) {
-        case DFU_STATE_RDY:
-            memcpy(txbuf, "\x00\x00\x00\x00\x02\x00", 6);
-            break;
-        case DFU_STATE_STP | DFU_STATE_BZY:
-            dfu_state &= 0x0F;
-        case DFU_STATE_RUN:
-        case DFU_STATE_ART:
-            memcpy(txbuf, "\x00\x50\x00\x00\x04\x00", 6);
-            break;
-        case DFU_STATE_STP:
-            memcpy(txbuf, "\x00\x00\x00\x00\x05\x00", 6);
-            break;
-        default: // DFU_STATE_ERR
-            memcpy(txbuf, "\x00\x50\x00\x00\x04\x00", 6);
-            break;
+    return FALSE;
+}
+
+static bool dfuFlushErase(void) {
+    bool erased = TRUE;
+
+    if (dfu_erase_page != 0) {
+        setupFlash();
+        flashUnlock();
+        erased = flashErasePage(dfu_erase_page);
+        flashLock();
+
+        dfu_erase_page = 0;
+    }
+
+    return erased;
+}
+
+/* Bring the part of a page at [addr, addr + len) to data */
+static uint8_t dfuProgramPage(uint32_t addr, const uint8_t *data, uint32_t len) {
+    uint32_t page = addr & ~(uint32_t)(FLASH_PAGE_SIZE - 1);
+    uint32_t idx = (page - FLASH_BASE) / FLASH_PAGE_SIZE;
+    bool erase = FALSE;
+    uint8_t status;
+
+    if (dfu_erase_page == page) {
+        /* The host asked for a blank page around the data */
+        erase = !flashIsBlank(page, addr - page) ||
+                !flashIsBlank(addr + len, page + FLASH_PAGE_SIZE - addr - len) ||
+                dfuNeedsErase(addr, data, len);
+        if (!erase) {
+            dfu_erase_page = 0;
+        } else if (!dfuFlushErase()) {
+            return DFU_STATUS_ERR_ERASE;
         }
-        chMtxUnlock(&dfu_cmd_mtx);
-
-        usbTransmit(&USBD1, USBD1_STLINK_TX_EP, txbuf, 6);
-    } else if (rxbuf[0] == 0xf3 && rxbuf[1] == 0x01) {
-        uint16_t len = rxbuf[6] | rxbuf[7] << 8;
-        uint8_t *p;
-        uint16_t size;
-
-        if ((dfu_state & DFU_STATE_BZY) == 0 && len <= sizeof(dfu_command) - 16) {
-            memcpy(dfu_command, rxbuf, 16);
-            p       = dfu_command + 16;
-            size    = sizeof(dfu_command) - 16;
-        } else {
-            chMtxLock(&dfu_cmd_mtx);
-            dfu_state |= DFU_STATE_ERR;
-            chMtxUnlock(&dfu_cmd_mtx);
+    }
+
+    if (!erase && memcmp((const void *)addr, data, len) == 0) {
+        dfu_pages_skipped++;
+        return DFU_STATUS_OK;
+    }
+
+    flashUnlock();
+    status = flashProgram(addr, data, len);
+    flashLock();
+
+    // A range erase went through the page before, the look-ahead or not
+    if (!erase && status == DFU_STATUS_OK && (idx >= DFU_ERASE_MAP_PAGES ||
+            (dfu_erase_done[idx / 32] & (1U << (idx % 32))) == 0)) {
+        dfu_pages_noerase++;
+    }
+
+    return status;
+}
+#endif
+
+/* Erase the page now if a range erase still owes it */
+static bool dfuErasePending(uint32_t page) {
+    uint32_t idx = (page - FLASH_BASE) / FLASH_PAGE_SIZE;
+    bool erased;
+
+    if (page < FLASH_BASE || idx >= DFU_ERASE_MAP_PAGES ||
+            (dfu_erase_map[idx / 32] & (1U << (idx % 32))) == 0) {
+        return TRUE;
+    }
+
+    setupFlash();
+    flashUnlock();
+    erased = flashErasePage(page);
+    flashLock();
 
-            p       = rxbuf;
-            size    = sizeof(rxbuf);
+    dfu_erase_map[idx / 32] &= ~(1U << (idx % 32));
+#if DFU_INCREMENTAL
+    if (erased) {
+        dfu_erase_done[idx / 32] |= 1U << (idx % 32);
+    }
+#endif
+    __atomic_store_n(&dfu_erase_left, dfu_erase_left - 1, __ATOMIC_RELEASE);
+
+    return erased;
+}
+
+/* One page of the range erase, the first one at or past the write cursor */
+static bool dfuEraseAhead(void) {
+    uint32_t idx, first = (dfu_erase_cursor - FLASH_BASE) / FLASH_PAGE_SIZE;
+
+    for (idx = 0; idx < DFU_ERASE_MAP_PAGES; idx++) {
+        uint32_t page = (first + idx) % DFU_ERASE_MAP_PAGES;
+
+        if (dfu_erase_map[page / 32] & (1U << (page % 32))) {
+            if (dfuErasePending(FLASH_BASE + page * FLASH_PAGE_SIZE)) {
+                return TRUE;
+            }
+
+            // Give up on the rest of the range
+            memset(dfu_erase_map, 0x00, sizeof(dfu_erase_map));
+            __atomic_store_n(&dfu_erase_left, 0, __ATOMIC_RELEASE);
+            return FALSE;
         }
+    }
+
+    __atomic_store_n(&dfu_erase_left, 0, __ATOMIC_RELEASE);
+
+    return TRUE;
+}
+
+/*
+ * Queue count pages from start for erasing, the bootloader pages are never
+ * touched. The worker erases them ahead of the data, dfu_erase_left counts
+ * down for the status reply.
+ */
+static uint8_t dfuEraseRange(uint32_t start, uint32_t count) {
+    uint32_t end = MIN(flashEnd(), FLASH_BASE + DFU_ERASE_MAP_PAGES * FLASH_PAGE_SIZE);
+    uint32_t idx;
+
+    if ((start & (FLASH_PAGE_SIZE - 1)) != 0 || start < FLASH_APP_BASE || start > end ||
+            count > (end - start) / FLASH_PAGE_SIZE) {
+        return DFU_STATUS_ERR_ADDRESS;
+    }
+
+#if DFU_INCREMENTAL
+    // A held back erase is done first, even inside the range it is cheap
+    if (!dfuFlushErase()) {
+        return DFU_STATUS_ERR_ERASE;
+    }
+#endif
+
+    for (idx = (start - FLASH_BASE) / FLASH_PAGE_SIZE; count > 0; idx++, count--) {
+        if ((dfu_erase_map[idx / 32] & (1U << (idx % 32))) == 0) {
+            dfu_erase_map[idx / 32] |= 1U << (idx % 32);
+            __atomic_store_n(&dfu_erase_left, dfu_erase_left + 1, __ATOMIC_RELEASE);
+        }
+#if DFU_INCREMENTAL
+        dfu_erase_done[idx / 32] &= ~(1U << (idx % 32));
+#endif
+    }
+    dfu_erase_cursor = start;
+
+    return DFU_STATUS_OK;
+}
+
+/*===========================================================================*/
+/* Compressed data chunks                                                    */
+/*===========================================================================*/
+
+/*
+ * Byte 8 of a data chunk header gives the payload format, bytes 10..11 the
+ * decompressed size of a compressed one. LZ4 block format, decrypted and
+ * checksummed as it came: the back references stay within the chunk and
+ * reach the part already programmed through the flash, so a page buffer
+ * is all the RAM it takes.
+ */
+#define DFU_FORMAT_RAW           0x00
+#define DFU_FORMAT_LZ4           0x01
+
+#define DFU_LZ_MAX_SIZE          (8 * 1024)     /* Decompressed bytes per chunk */
+
+typedef struct {
+    uint32_t start;             /* Address of the first decompressed byte */
+    uint32_t addr;              /* Address of the next one */
+    uint32_t end;
+    uint32_t fill;              /* Bytes in dfu_lz_page, up to addr */
+    uint8_t status;
+} dfu_lz_out_t;
+
+static uint8_t dfu_lz_page[FLASH_PAGE_SIZE];
+
+/* Returns a DFU bStatus code */
+static uint8_t dfuProgram(uint32_t addr, const uint8_t *data, uint32_t len) {
+#if DFU_INCREMENTAL
+    return dfuProgramPage(addr, data, len);
+#else
+    uint8_t status;
+
+    flashUnlock();
+    status = flashProgram(addr, data, len);
+    flashLock();
+
+    return status;
+#endif
+}
+
+/* The page buffer goes to the flash at a page boundary and at the end */
+static bool dfuLzPut(dfu_lz_out_t *out, uint8_t byte) {
+    dfu_lz_page[out->fill++] = byte;
+    out->addr++;
+
+    if (out->addr == out->end || (out->addr & (FLASH_PAGE_SIZE - 1)) == 0) {
+        if (out->fill & 1) {
+            dfu_lz_page[out->fill] = 0xff;
+        }
+        out->status = dfuProgram(out->addr - out->fill, dfu_lz_page, (out->fill + 1) & ~1);
+        out->fill = 0;
+    }
+
+    return out->status == DFU_STATUS_OK;
+}
+
+static uint8_t dfuLzBack(const dfu_lz_out_t *out, uint32_t offset) {
+    uint32_t addr = out->addr - offset;
+
+    if (addr >= out->addr - out->fill) {
+        return dfu_lz_page[addr - (out->addr - out->fill)];
+    }
+
+    return *(const uint8_t *)addr;
+}
+
+/* LZ4 length: the nibble, plus bytes while they are 255 */
+static bool dfuLzLength(const uint8_t **src, const uint8_t *end, uint32_t *len) {
+    uint8_t more;
+
+    if (*len == 15) {
         do {
-            msg = usbReceive(&USBD1, USBD1_STLINK_RX_EP, p, MIN(size, len));
-            if (msg <= 0) {
-                chMtxLock(&dfu_cmd_mtx);
-                dfu_state = DFU_STATE_RDY;
-                chMtxUnlock(&dfu_cmd_mtx);
-                break;
+            if (*src >= end) {
+                return FALSE;
             }
+            more = *(*src)++;
+            *len += more;
+        } while (more == 255);
+    }
 
-            p       += MIN(size, len);
-            len     -= (uint16_t)msg;
-        } while (len > 0);
+    return TRUE;
+}
 
-        if (dfu_state == DFU_STATE_RDY && len > 0) continue;
+/* Returns a DFU bStatus code */
+static uint8_t dfuLzDecode(uint32_t addr, uint32_t size, const uint8_t *src, uint32_t len) {
+    const uint8_t *end = src + len;
+    dfu_lz_out_t out = { addr, addr, addr + size, 0, DFU_STATUS_OK };
+    uint32_t lit, match, offset;
+    uint8_t token;
 
-        chMtxLock(&dfu_cmd_mtx);
-        dfu_state = DFU_STATE_RUN;
-        chMtxUnlock(&dfu_cmd_mtx);
+    while (out.addr < out.end) {
+        if (src >= end) {
+            return DFU_STATUS_ERR_TARGET;
+        }
+        token = *src++;
 
-        chSemSignal(&dfu_cmd_sem);
-    } else if (!memcmp(rxbuf, "\xf3\x09\x16\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00", 16)) {
-        volatile uint8_t *p = (volatile uint8_t *)(FLASH_BASE + 15 * 1024 + 0x30);
-        uint8_t len = rxbuf[2];
-        memcpy(txbuf, (void *)p, len);
-        usbTransmit(&USBD1, USBD1_STLINK_TX_EP, txbuf, len);
-    } else if (!memcmp(rxbuf, "\xf3\x07\x00\x00", 4) && msg == 16) {
-        // Exit DFU mode
-        usbDisconnectBus(&USBD1);
-        chThdSleepMilliseconds(1500);
+        lit = token >> 4;
+        if (!dfuLzLength(&src, end, &lit) || lit > (uint32_t)(end - src) || lit > out.end - out.addr) {
+            return DFU_STATUS_ERR_TARGET;
+        }
+        while (lit-- > 0) {
+            if (!dfuLzPut(&out, *src++)) {
+                return out.status;
+            }
+        }
 
-        BKP->DR1 = 0xfeed;
+        // The last sequence has literals only
+        if (out.addr == out.end) {
+            break;
+        }
+
+        if (end - src < 2) {
+            return DFU_STATUS_ERR_TARGET;
+        }
+        offset = src[0] | src[1] << 8;
+        src += 2;
 
-        NVIC_SystemReset();
+        match = token & 0x0f;
+        if (!dfuLzLength(&src, end, &match)) {
+            return DFU_STATUS_ERR_TARGET;
+        }
+        match += 4;
+        if (offset == 0 || offset > out.addr - out.start || match > out.end - out.addr) {
+            return DFU_STATUS_ERR_TARGET;
+        }
+        while (match-- > 0) {
+            if (!dfuLzPut(&out, dfuLzBack(&out, offset))) {
+                return out.status;
+            }
+        }
     }
-  }
+
+    return DFU_STATUS_OK;
 }
 
-static THD_WORKING_AREA(waDfuWorker, 2048);
-static __attribute__((noreturn)) THD_FUNCTION(DfuWorker, arg) {
-    (void)arg;
-    uint32_t location;
+/*
+ * Decrypts, checks and commits one chunk, returns a DFU bStatus code:
+ * errTARGET on a checksum mismatch, nothing is programmed then.
+ */
+static uint8_t dfuHandleChunk(uint8_t *dfu_command) {
+    static uint32_t location;
+    uint16_t seq, checksum, len, tmp;
+
+    if (dfu_command[0] == 0xf3 && dfu_command[1] == 0x01) {
+        seq         = dfu_command[2] | dfu_command[3] << 8;
+        checksum    = dfu_command[4] | dfu_command[5] << 8;
+        len         = dfu_command[6] | dfu_command[7] << 8;
+        if ((seq & 0x06) != 0) {
+            tmp = dfuDecryptChunk(dfu_command + 16, len);
+        } else {
+            rtcnt_t start = chSysGetRealtimeCounterX();
 
-    chRegSetThreadName("DfuWorker");
-    while (true) {
-        uint16_t seq, checksum, len, idx, tmp;
-
-        chSemWait(&dfu_cmd_sem);
-
-        if (dfu_command[0] == 0xf3 && dfu_command[1] == 0x01) {
-            seq         = dfu_command[2] | dfu_command[3] << 8;
-            checksum    = dfu_command[4] | dfu_command[5] << 8;
-            len         = dfu_command[6] | dfu_command[7] << 8;
-            if ((seq & 0x06) != 0) {
-                const uint8_t salt[] = {
-                    0x29, 0xf1, 0x95, 0x64, 0xcc, 0xdb, 0xde, 0xf9,
-                    0x3b, 0xd1, 0xe7, 0x7d, 0x8a, 0x89, 0xb9, 0xbf
-                };
-                uint8_t devuid[16] = {
-                    0x80, 0x00, 0xff, 0xff,
-                    'b', 'r', 'o', 'b',
-                    'w', 'i', 'n', 'd',
-                    '.', 'c', 'o', 'm'
-                };
-
-                uint8_t deckey[16];
-                AES_KEY aes_key;
-
-                AES_set_decrypt_key(devuid, 128, &aes_key);
-                AES_decrypt(salt, deckey, &aes_key);
-
-                AES_set_encrypt_key(deckey, 128, &aes_key);
-                memcpy(devuid + 4, (void *)0x1FFFF7E8, 12);
-                AES_encrypt(devuid, deckey, &aes_key);
-                AES_set_decrypt_key(deckey, 128, &aes_key);
-
-                for (idx = 0; idx < len; idx += 16) {
-                    AES_decrypt(dfu_command + 16 + idx, dfu_command + 16 + idx, &aes_key);
+            tmp = dfuChecksum(dfu_command + 16, len);
+            dfuProfSince(DFU_PROF_CHECKSUM, start);
+        }
+
+        // Nothing is programmed before the whole chunk checks out
+        if (tmp != checksum) { // Checksum mismatch
+            dfuTrace(DFU_TRACE_CHECKSUM_FAIL, 0, seq);
+            return DFU_STATUS_ERR_TARGET;
+        }
+
+        if (seq == 0x0000 && len == 0x0005) { // Location or erase command
+            if (dfu_command[16] == 0x21 || dfu_command[16] == 0x41) {
+                location = dfu_command[16 + 1] <<  0 |
+                        dfu_command[16 + 2] <<  8 |
+                        dfu_command[16 + 3] << 16 |
+                        dfu_command[16 + 4] << 24;
+            }
+            if (dfu_command[16] == 0x41) { // Erase flash block
+#if DFU_INCREMENTAL
+                uint32_t page = location & ~(uint32_t)(FLASH_PAGE_SIZE - 1);
+
+                // Held back until the data for the page is in
+                if (dfu_erase_page != page && !dfuFlushErase()) {
+                    return DFU_STATUS_ERR_ERASE;
                 }
+                dfu_erase_page = page;
+#else
+                bool erased;
+
+                // 1. Setup flash clock
+                setupFlash();
+                // 2. Unlock flash
+                flashUnlock();
+                // 3. Erase flash block, skipped when it is blank already
+                erased = flashErasePage(location);
+                // 4. Lock flash
+                flashLock();
+
+                if (!erased) {
+                    return DFU_STATUS_ERR_ERASE;
+                }
+#endif
             }
-            for (idx = 0, tmp = 0; idx < len; idx++) {
-                tmp += dfu_command[16 + idx];
+        }
+        else if (seq == 0x0000 && (len == 0x0001 || len == 0x0007) && dfu_command[16] == 0x41) {
+            uint32_t start = FLASH_APP_BASE, count;
+
+            if (len == 0x0007) { // Range erase: address and page count
+                start = dfu_command[16 + 1] <<  0 |
+                        dfu_command[16 + 2] <<  8 |
+                        dfu_command[16 + 3] << 16 |
+                        dfu_command[16 + 4] << 24;
+                count = dfu_command[16 + 5] | dfu_command[16 + 6] << 8;
+            } else { // The whole application area
+                count = (flashEnd() - FLASH_APP_BASE) / FLASH_PAGE_SIZE;
             }
 
-            if (tmp != checksum) { // Checksum mismatch
-                chMtxLock(&dfu_cmd_mtx);
-                dfu_state = DFU_STATE_ART;
-                chMtxUnlock(&dfu_cmd_mtx);
-                continue;
+            return dfuEraseRange(start, count);
+        }
+        else if ((seq & 0x06) != 0) {
+            uint8_t format = dfu_command[8];
+            uint16_t size = format == DFU_FORMAT_LZ4 ? dfu_command[10] | dfu_command[11] << 8 : len;
+            uint32_t page, end = location + ((size + 1) & ~1);
+            uint8_t status;
+
+            if ((format != DFU_FORMAT_RAW && format != DFU_FORMAT_LZ4) || size > DFU_LZ_MAX_SIZE) {
+                return DFU_STATUS_ERR_TARGET;
             }
+            dfu_bytes_wire += len;
+            dfu_bytes_image += size;
 
-            if (seq == 0x0000 && len == 0x0005) { // Location or erase command
-                if (dfu_command[16] == 0x21 || dfu_command[16] == 0x41) {
-                    location = dfu_command[16 + 1] <<  0 |
-                            dfu_command[16 + 2] <<  8 |
-                            dfu_command[16 + 3] << 16 |
-                            dfu_command[16 + 4] << 24;
-                }
-                if (dfu_command[16] == 0x41) { // Erase flash block
-                    // 1. Setup flash clock
-                    setupFlash();
-                    // 2. Unlock flash
-                    flashUnlock();
-                    // 3. Erase flash block
-                    flashErasePage(location);
-                    // 4. Lock flash
-                    flashLock();
+            // Range erase pages the look-ahead has not got to yet
+            for (page = location & ~(uint32_t)(FLASH_PAGE_SIZE - 1); page < end; page += FLASH_PAGE_SIZE) {
+                if (!dfuErasePending(page)) {
+                    return DFU_STATUS_ERR_ERASE;
                 }
             }
-            else if ((seq & 0x06) != 0) {
-                // 1. Unlock flash
-                flashUnlock();
+            dfu_erase_cursor = end;
 
-                // 2. Write data to flash
-                for (idx = 0; idx < len; idx += 4) {
-                    uint32_t word, read;
-                    word = dfu_command[16 + idx + 0] <<  0 |
-                        dfu_command[16 + idx + 1] <<  8 |
-                        dfu_command[16 + idx + 2] << 16 |
-                        dfu_command[16 + idx + 3] << 24;
-                    read = flashWriteWord(location + idx, word);
-                    if (read != TRUE) {
-                    }
-                }
+#if DFU_INCREMENTAL
+            uint32_t addr = location;
 
-                // 3. Lock flash
-                flashLock();
+            // A held back erase for a page this data does not touch
+            if (dfu_erase_page != 0 && (dfu_erase_page + FLASH_PAGE_SIZE <= addr ||
+                    dfu_erase_page >= end) && !dfuFlushErase()) {
+                return DFU_STATUS_ERR_ERASE;
             }
+#endif
+
+            if (format == DFU_FORMAT_LZ4) {
+                return dfuLzDecode(location, size, dfu_command + 16, len);
+            }
+
+#if DFU_INCREMENTAL
+            // Page by page
+            for (status = DFU_STATUS_OK; addr < end && status == DFU_STATUS_OK; ) {
+                uint32_t next = MIN((addr & ~(uint32_t)(FLASH_PAGE_SIZE - 1)) + FLASH_PAGE_SIZE, end);
+
+                status = dfuProgramPage(addr, dfu_command + 16 + (addr - location), next - addr);
+                addr = next;
+            }
+
+            return status;
+#else
+            // 1. Unlock flash
+            flashUnlock();
+
+            // 2. Write data to flash
+            status = flashProgram(location, dfu_command + 16, (len + 1) & ~1);
+
+            // 3. Lock flash
+            flashLock();
+
+            return status;
+#endif
         }
+    }
 
-        chMtxLock(&dfu_cmd_mtx);
-        dfu_state = DFU_STATE_STP | DFU_STATE_BZY;
-        chMtxUnlock(&dfu_cmd_mtx);
+    return DFU_STATUS_OK;
+}
+
+static THD_WORKING_AREA(waDfuWorker, 2048);
+static __attribute__((noreturn)) THD_FUNCTION(DfuWorker, arg) {
+    (void)arg;
+
+    chRegSetThreadName("DfuWorker");
+    while (true) {
+        dfu_chunk_t *chunk;
+        msg_t msg;
+        uint8_t status;
+        bool failed;
+
+        /* Nothing queued: erase the range erase pages ahead meanwhile */
+        if (chMBFetch(&dfu_chunk_mb, &msg, dfu_erase_left != 0 ? TIME_IMMEDIATE : TIME_INFINITE) != MSG_OK) {
+            bool erased;
+
+            dfuJobBegin(DFU_JOB_ERASE);
+            erased = dfuEraseAhead();
+            dfuJobEnd();
+
+            if (!erased) {
+                DFU_LOG("dfu: erase ahead failed at 0x%08x\r\n", dfu_erase_cursor);
+                dfuSyncSet(DFU_SYNC(0xff, 0xff, 0, 0), DFU_SYNC(DFU_STATE_ART, DFU_STATUS_ERR_ERASE, 0, 0));
+            }
+            continue;
+        }
+        chunk = (dfu_chunk_t *)msg;
+
+        /* Nothing after a failed chunk gets committed */
+        failed = dfuSyncFailed(dfuSyncLoad());
+
+        if (!failed) {
+            /* Location and erase commands against data chunks */
+            dfuJobBegin(chunk->command[2] == 0 && chunk->command[3] == 0 ? DFU_JOB_CMD : DFU_JOB_DATA);
+            status = dfuHandleChunk(chunk->command);
+            dfuJobEnd();
+
+            if (status != DFU_STATUS_OK) {
+                DFU_LOG("dfu: chunk %u failed, status %u\r\n",
+                        chunk->command[2] | chunk->command[3] << 8, status);
+                dfuSyncSet(DFU_SYNC(0xff, 0xff, 0, 0), DFU_SYNC(DFU_STATE_ART, status, 0, 0));
+            }
+        }
+
+        chPoolFree(&dfu_chunk_pool, chunk);
+        chSemSignal(&dfu_chunk_sem);
+
+        __atomic_fetch_sub(&dfu_sync, DFU_SYNC(0, 0, 1, 0), __ATOMIC_ACQ_REL);
+    }
+}
+
+/*
+ * Drains the telemetry ring to the trace endpoint, in whole records of up
+ * to 64 bytes. Blocks while nobody reads the endpoint, the ring keeps
+ * taking records and counts what it has to drop. Sleeps while the ring is
+ * empty, dfuTrace() wakes it.
+ */
+static THD_WORKING_AREA(waDfuTrace, 256);
+static __attribute__((noreturn)) THD_FUNCTION(DfuTrace, arg) {
+  (void)arg;
+  dfu_trace_t packet[DFU_TRACE_PER_PACKET];
+
+  chRegSetThreadName("DfuTrace");
+  while (true) {
+    uint32_t count = 0, dropped;
+
+    chSysLock();
+    dropped = dfu_trace_dropped;
+    dfu_trace_dropped = 0;
+    chSysUnlock();
+
+    if (dropped != 0) {
+        packet[count].time = chSysGetRealtimeCounterX();
+        packet[count].event = DFU_TRACE_DROPPED;
+        packet[count].arg = 0;
+        packet[count].value = MIN(dropped, 0xffff);
+        count++;
     }
+
+    chSysLock();
+    while (count < DFU_TRACE_PER_PACKET && dfu_trace_tail != dfu_trace_head) {
+        packet[count++] = dfu_trace[dfu_trace_tail++ % DFU_TRACE_NUM];
+    }
+    chSysUnlock();
+
+    if (count == 0) {
+        chBSemWait(&dfu_trace_bsem);
+        continue;
+    }
+
+    if (usbTransmit(&USBD1, USBD1_STLINK_TRACE_EP, (uint8_t *)packet,
+            count * sizeof(dfu_trace_t)) == MSG_RESET) {
+        chThdSleepMilliseconds(500);
+    }
+  }
 }
 
 /*===========================================================================*/
@@ -373,40 +1631,61 @@ void JumpToUserApp(uint32_t pAppAddr) {
 }
 
 /*
- * Application entry point.
+ * Starts the application straight out of reset, still on HSI: the clock
+ * and HAL bring-up would start HSE, PLL and the drivers only for the
+ * application to set them up again. Only the backup domain is touched,
+ * and it is put back the way the reset left it.
  */
-int __attribute__((noreturn)) main(void) {
-  /*
-   * System initializations.
-   * - HAL initialization, this also initializes the configured device drivers
-   *   and performs the board-specific initializations.
-   */
-  halInit();
+static void bootApp(void) {
+  uint32_t flashSize, magicValue;
+  bool jump;
+
+  /* Check the firmware intergrity */
+  flashSize = (*(volatile uint32_t *)0x1FFFF7E0 & 0xffff) << 10;
+  /* Magic value locate at the last 4 bytes in the flash */
+  magicValue = *(volatile uint32_t *)(flashSize - 4);
+  if (magicValue != 0xa50027d3) {
+    return;
+  }
 
-  do {
-    uint32_t flashSize, magicValue;
+  /* BKP->DR1 needs the PWR and BKP clocks, writing it backup domain access */
+  RCC->APB1ENR |= RCC_APB1ENR_PWREN | RCC_APB1ENR_BKPEN;
+  (void)RCC->APB1ENR;
 
-    /* Check the firmware intergrity */
-    flashSize = (*(volatile uint32_t *)0x1FFFF7E0 & 0xffff) << 10;
-    /* Magic value locate at the last 4 bytes in the flash */
-    magicValue = *(volatile uint32_t *)(flashSize - 4);
-    if (magicValue != 0xa50027d3) {
-      break;
-    }
+  /* Check power on reason, a software reset stays unless it left DFU mode */
+  jump = (RCC->CSR & RCC_CSR_SFTRSTF) == 0 || BKP->DR1 == 0xfeed;
 
-    /* Check power on reason */
-    if ((RCC->CSR & RCC_CSR_SFTRSTF) != 0 && BKP->DR1 != 0xfeed) {
-      /* Software reset occurred */
-      break;
-    }
+  if (jump && BKP->DR1 == 0xfeed) {
+    PWR->CR |= PWR_CR_DBP;
+    BKP->DR1 = 0x0000;
+    PWR->CR &= ~PWR_CR_DBP;
+  }
 
-    if (BKP->DR1 == 0xfeed) BKP->DR1 = 0x0000;
+  RCC->APB1ENR &= ~(RCC_APB1ENR_PWREN | RCC_APB1ENR_BKPEN);
 
+  if (jump) {
     /* Clear reset flag */
     RCC->CSR |= RCC_CSR_RMVF;
 
-    JumpToUserApp(0x08004000);
-  } while (0);
+    JumpToUserApp(FLASH_APP_BASE);
+  }
+}
+
+/*
+ * Application entry point.
+ */
+int __attribute__((noreturn)) main(void) {
+  bootApp();
+
+  /* HSE and PLL, left out of __early_init() for the application's sake */
+  stm32_clock_init();
+
+  /*
+   * System initializations.
+   * - HAL initialization, this also initializes the configured device drivers
+   *   and performs the board-specific initializations.
+   */
+  halInit();
 
   /*
    * System initializations.
@@ -419,6 +1698,9 @@ int __attribute__((noreturn)) main(void) {
    * Activates the serial driver 2 using the driver default configuration.
    */
   sdStart(&SD2, NULL);
+#if DFU_DEBUG
+  bdlogStart(&SD2, LOWPRIO);
+#endif
 
   /*
    * Activates the USB driver and then the USB bus pull-up on D+.
@@ -435,15 +1717,18 @@ int __attribute__((noreturn)) main(void) {
    */
   chThdCreateStatic(waLedBlinker, sizeof(waLedBlinker), NORMALPRIO, LedBlinker, NULL);
 
-  chSemObjectInit(&dfu_cmd_sem, 0);
+  chPoolObjectInit(&dfu_chunk_pool, sizeof(dfu_chunk_t), NULL);
+  chPoolLoadArray(&dfu_chunk_pool, dfu_chunks, DFU_CHUNK_NUM);
+  chSemObjectInit(&dfu_chunk_sem, DFU_CHUNK_NUM);
+  chMBObjectInit(&dfu_chunk_mb, dfu_chunk_mb_buf, DFU_CHUNK_NUM);
   chSemObjectInit(&dfu_cmd_sem_action, 0);
-  chMtxObjectInit(&dfu_cmd_mtx);
 
   /*
    * Starting threads.
    */
   chThdCreateStatic(waDfuCmd, sizeof(waDfuCmd), NORMALPRIO, DfuCmd, NULL);
   chThdCreateStatic(waDfuWorker, sizeof(waDfuWorker), NORMALPRIO, DfuWorker, NULL);
+  chThdCreateStatic(waDfuTrace, sizeof(waDfuTrace), NORMALPRIO - 1, DfuTrace, NULL);
 
   /*
    * Normal main() thread activity, in this demo it does nothing except
@@ -41,6 +41,11 @@
 #define STM32_PVD_ENABLE                    FALSE
 #define STM32_PLS                           STM32_PLS_LEV0
 
+/*
+ * DMA settings, main.c feeds the CRC unit through DMA1 channel 1.
+ */
+#define STM32_DMA_REQUIRED
+
 /*
  * ADC driver system settings.
  */
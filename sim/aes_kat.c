@@ -0,0 +1,125 @@
+/*
+ * Copyright (C) 2017 https://www.brobwind.com
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * FIPS-197 known answer test of bro_aes.c, built once per backend
+ * configuration by "make -C sim check-aes".
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "bro_aes.h"
+
+
+typedef struct {
+    const char *name;
+    uint8_t key[16];
+    uint8_t plain[16];
+    uint8_t cipher[16];
+} aes_kat_t;
+
+/* FIPS-197 appendix B and C.1, AES-128, as printed in the standard */
+static const aes_kat_t aes_kats[] = {
+    { "FIPS-197 B",
+      { 0x2b, 0x7e, 0x15, 0x16, 0x28, 0xae, 0xd2, 0xa6, 0xab, 0xf7, 0x15, 0x88, 0x09, 0xcf, 0x4f, 0x3c },
+      { 0x32, 0x43, 0xf6, 0xa8, 0x88, 0x5a, 0x30, 0x8d, 0x31, 0x31, 0x98, 0xa2, 0xe0, 0x37, 0x07, 0x34 },
+      { 0x39, 0x25, 0x84, 0x1d, 0x02, 0xdc, 0x09, 0xfb, 0xdc, 0x11, 0x85, 0x97, 0x19, 0x6a, 0x0b, 0x32 } },
+    { "FIPS-197 C.1",
+      { 0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x08, 0x09, 0x0a, 0x0b, 0x0c, 0x0d, 0x0e, 0x0f },
+      { 0x00, 0x11, 0x22, 0x33, 0x44, 0x55, 0x66, 0x77, 0x88, 0x99, 0xaa, 0xbb, 0xcc, 0xdd, 0xee, 0xff },
+      { 0x69, 0xc4, 0xe0, 0xd8, 0x6a, 0x7b, 0x04, 0x30, 0xd8, 0xcd, 0xb7, 0x80, 0x70, 0xb4, 0xc5, 0x5a } },
+};
+
+#define AES_KAT_NUM                     (sizeof(aes_kats) / sizeof(aes_kats[0]))
+
+/* This implementation's byte order: unless STANDARD_AS_OPENSSL is set,
+   the state and key words are loaded without a byte swap, so every 32-bit
+   word of the key and of the texts is byte reversed */
+static void aes_kat_order(uint8_t *out, const uint8_t *in) {
+    uint32_t idx;
+
+    for (idx = 0; idx < 16; idx++) {
+        out[idx] = STANDARD_AS_OPENSSL ? in[idx] : in[(idx & ~3U) + 3 - (idx & 3)];
+    }
+}
+
+static int aes_kat_check(const char *name, const char *what, const uint8_t *got, const uint8_t *want) {
+    uint32_t idx;
+
+    if (memcmp(got, want, 16) == 0) {
+        return 0;
+    }
+
+    printf("aes kat: %s, %s mismatch:", name, what);
+    for (idx = 0; idx < 16; idx++) {
+        printf(" %02x", got[idx]);
+    }
+    printf("\n");
+
+    return 1;
+}
+
+int main(void) {
+    uint8_t key[16], plain[16], cipher[16];
+    uint8_t in[2 * 16] __attribute__((aligned(4)));
+    uint8_t out[3 * 16] __attribute__((aligned(4)));
+    uint32_t idx, blk;
+    AES_KEY enc_key, dec_key;
+    int failed = 0;
+
+    for (idx = 0; idx < AES_KAT_NUM; idx++) {
+        const aes_kat_t *kat = &aes_kats[idx];
+
+        aes_kat_order(key, kat->key);
+        aes_kat_order(plain, kat->plain);
+        aes_kat_order(cipher, kat->cipher);
+
+        AES_set_encrypt_key(key, 128, &enc_key);
+        AES_set_decrypt_key(key, 128, &dec_key);
+
+        AES_encrypt(plain, out, &enc_key);
+        failed |= aes_kat_check(kat->name, "AES_encrypt", out, cipher);
+        AES_decrypt(cipher, out, &dec_key);
+        failed |= aes_kat_check(kat->name, "AES_decrypt", out, plain);
+
+        /* Two blocks at once, the bitsliced path when AES_BITSLICE is set */
+        memcpy(in, cipher, 16);
+        memcpy(in + 16, cipher, 16);
+        AES_decrypt2(in, out, &dec_key);
+        failed |= aes_kat_check(kat->name, "AES_decrypt2 block 0", out, plain);
+        failed |= aes_kat_check(kat->name, "AES_decrypt2 block 1", out + 16, plain);
+
+        /* An odd block count and in place, as the bootloader decrypts */
+        for (blk = 0; blk < 3; blk++) {
+            memcpy(out + 16 * blk, plain, 16);
+        }
+        AES_encrypt_blocks(out, out, 3, &enc_key);
+        for (blk = 0; blk < 3; blk++) {
+            failed |= aes_kat_check(kat->name, "AES_encrypt_blocks", out + 16 * blk, cipher);
+        }
+        AES_decrypt_blocks(out, out, 3, &dec_key);
+        for (blk = 0; blk < 3; blk++) {
+            failed |= aes_kat_check(kat->name, "AES_decrypt_blocks", out + 16 * blk, plain);
+        }
+    }
+
+    printf("aes kat: STANDARD_AS_OPENSSL=%d AES_IN_RAM=%d AES_TD_TABLES=%d AES_BITSLICE=%d, %s\n",
+        STANDARD_AS_OPENSSL, AES_IN_RAM, AES_TD_TABLES, AES_BITSLICE, failed ? "FAILED" : "ok");
+
+    return failed;
+}
@@ -0,0 +1,188 @@
+/*
+ * Copyright (C) 2017 https://www.brobwind.com
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Host simulator stand-in for the ChibiOS/RT kernel API used by the
+ * bootloader.
+ *
+ * Every simulated thread is a pthread, but only the one holding the
+ * "kernel" lock runs. The lock is dropped around blocking calls only, so
+ * threads at the same priority behave cooperatively as they do on the
+ * target: a busy-wait loop starves everybody else.
+ */
+
+#ifndef _SIM_CH_H_
+#define _SIM_CH_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <pthread.h>
+
+#ifndef TRUE
+#define TRUE                            1
+#endif
+#ifndef FALSE
+#define FALSE                           0
+#endif
+
+#define CH_CFG_ST_FREQUENCY             2000
+
+/* Wide enough to carry a pointer through a mailbox, as on the target */
+typedef intptr_t msg_t;
+typedef int32_t cnt_t;
+typedef uint32_t systime_t;
+typedef uint32_t tprio_t;
+typedef uint32_t stkalign_t;
+typedef uint32_t rtcnt_t;
+typedef void (*tfunc_t)(void *p);
+
+#define MSG_OK                          (msg_t)0
+#define MSG_TIMEOUT                     (msg_t)-1
+#define MSG_RESET                       (msg_t)-2
+
+#define LOWPRIO                         2
+#define NORMALPRIO                      128
+#define TIME_IMMEDIATE                  ((systime_t)0)
+#define TIME_INFINITE                   ((systime_t)-1)
+
+#define S2ST(sec)                       ((systime_t)((uint32_t)(sec) * CH_CFG_ST_FREQUENCY))
+#define MS2ST(msec)                     ((systime_t)(((uint32_t)(msec) * CH_CFG_ST_FREQUENCY + 999) / 1000))
+#define US2ST(usec)                     ((systime_t)(((uint32_t)(usec) * CH_CFG_ST_FREQUENCY + 999999) / 1000000))
+#define ST2MS(n)                        ((uint32_t)(((n) * 1000 + CH_CFG_ST_FREQUENCY - 1) / CH_CFG_ST_FREQUENCY))
+
+/*===========================================================================*/
+/* Threads                                                                   */
+/*===========================================================================*/
+
+typedef struct sim_thread {
+  pthread_t             tid;
+  const char            *name;
+  tfunc_t               pf;
+  void                  *arg;
+} thread_t;
+
+#define THD_WORKING_AREA(s, n)          stkalign_t s[((n) + sizeof(stkalign_t) - 1) / sizeof(stkalign_t)]
+#define THD_FUNCTION(tname, arg)        void tname(void *arg)
+
+thread_t *chThdCreateStatic(void *wsp, size_t size, tprio_t prio, tfunc_t pf, void *arg);
+void chRegSetThreadName(const char *name);
+void chThdSleep(systime_t time);
+void chThdSleepMilliseconds(uint32_t msec);
+void chThdSleepMicroseconds(uint32_t usec);
+systime_t chVTGetSystemTime(void);
+#define chVTGetSystemTimeX()            chVTGetSystemTime()
+
+/* Cycle counter of a core running at STM32_HCLK */
+rtcnt_t chSysGetRealtimeCounterX(void);
+#define RTC2US(freq, n)                 ((((n) - 1UL) / ((freq) / 1000000UL)) + 1UL)
+
+void chSysInit(void);
+#define chSysLock()
+#define chSysUnlock()
+#define chSysLockFromISR()
+#define chSysUnlockFromISR()
+/* Signalled threads already run on their own */
+#define chSchRescheduleS()
+
+/*===========================================================================*/
+/* Semaphores and mutexes                                                    */
+/*===========================================================================*/
+
+typedef struct {
+  pthread_mutex_t       mtx;
+  pthread_cond_t        cond;
+  cnt_t                 cnt;
+} semaphore_t;
+
+#define _SEMAPHORE_DATA(name, n)        {PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, n}
+#define SEMAPHORE_DECL(name, n)         semaphore_t name = _SEMAPHORE_DATA(name, n)
+
+void chSemObjectInit(semaphore_t *sp, cnt_t n);
+msg_t chSemWait(semaphore_t *sp);
+msg_t chSemWaitTimeout(semaphore_t *sp, systime_t time);
+void chSemSignal(semaphore_t *sp);
+#define chSemSignalI(sp)                chSemSignal(sp)
+
+typedef struct {
+  semaphore_t           sem;
+} binary_semaphore_t;
+
+#define _BSEMAPHORE_DATA(name, taken)   {_SEMAPHORE_DATA(name.sem, ((taken) ? 0 : 1))}
+#define BSEMAPHORE_DECL(name, taken)    binary_semaphore_t name = _BSEMAPHORE_DATA(name, taken)
+
+#define chBSemWait(bsp)                 chSemWait(&(bsp)->sem)
+#define chBSemWaitTimeout(bsp, time)    chSemWaitTimeout(&(bsp)->sem, time)
+void chBSemSignal(binary_semaphore_t *bsp);
+#define chBSemSignalI(bsp)              chBSemSignal(bsp)
+
+typedef struct {
+  pthread_mutex_t       mtx;
+} mutex_t;
+
+#define _MUTEX_DATA(name)               {PTHREAD_MUTEX_INITIALIZER}
+#define MUTEX_DECL(name)                mutex_t name = _MUTEX_DATA(name)
+
+void chMtxObjectInit(mutex_t *mp);
+void chMtxLock(mutex_t *mp);
+void chMtxUnlock(mutex_t *mp);
+
+/*===========================================================================*/
+/* Memory pools and mailboxes                                                */
+/*===========================================================================*/
+
+struct pool_header {
+  struct pool_header    *next;
+};
+
+typedef void *(*memgetfunc_t)(size_t size);
+
+typedef struct {
+  pthread_mutex_t       mtx;
+  struct pool_header    *next;
+  size_t                object_size;
+  memgetfunc_t          provider;
+} memory_pool_t;
+
+#define _MEMORYPOOL_DATA(name, size, provider)                              \
+  {PTHREAD_MUTEX_INITIALIZER, NULL, size, provider}
+#define MEMORYPOOL_DECL(name, size, provider)                               \
+  memory_pool_t name = _MEMORYPOOL_DATA(name, size, provider)
+
+void chPoolObjectInit(memory_pool_t *mp, size_t size, memgetfunc_t provider);
+void chPoolLoadArray(memory_pool_t *mp, void *p, size_t n);
+void *chPoolAlloc(memory_pool_t *mp);
+void chPoolFree(memory_pool_t *mp, void *objp);
+
+typedef struct {
+  pthread_mutex_t       mtx;
+  pthread_cond_t        cond;
+  msg_t                 *buffer;
+  size_t                size;
+  size_t                rdidx;
+  size_t                cnt;
+} mailbox_t;
+
+#define _MAILBOX_DATA(name, buffer, size)                                   \
+  {PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, buffer, size, 0, 0}
+#define MAILBOX_DECL(name, buffer, size)                                    \
+  mailbox_t name = _MAILBOX_DATA(name, buffer, size)
+
+void chMBObjectInit(mailbox_t *mbp, msg_t *buf, size_t n);
+msg_t chMBPost(mailbox_t *mbp, msg_t msg, systime_t timeout);
+msg_t chMBFetch(mailbox_t *mbp, msg_t *msgp, systime_t timeout);
+
+#endif /* _SIM_CH_H_ */
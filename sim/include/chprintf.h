@@ -0,0 +1,27 @@
+/*
+ * Copyright (C) 2017 https://www.brobwind.com
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _SIM_CHPRINTF_H_
+#define _SIM_CHPRINTF_H_
+
+#include <stdarg.h>
+
+#include "hal.h"
+
+int chvprintf(BaseSequentialStream *chp, const char *fmt, va_list ap);
+int chprintf(BaseSequentialStream *chp, const char *fmt, ...);
+
+#endif /* _SIM_CHPRINTF_H_ */
@@ -0,0 +1,394 @@
+/*
+ * Copyright (C) 2017 https://www.brobwind.com
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Host simulator stand-in for the ChibiOS HAL, the STM32F103 register
+ * definitions and the board file used by the bootloader.
+ */
+
+#ifndef _SIM_HAL_H_
+#define _SIM_HAL_H_
+
+#include "ch.h"
+
+/*===========================================================================*/
+/* Board                                                                     */
+/*===========================================================================*/
+
+#define BOARD_NAME                      "BRO-DBG-LINK - V2.1 (simulator)"
+
+#define GPIOA_LED                       9
+#define GPIOA_USB_DISC                  15
+
+#define STM32_HCLK                      72000000
+
+/*===========================================================================*/
+/* STM32F103xB registers                                                     */
+/*===========================================================================*/
+
+#define FLASH_BASE                      ((uint32_t)0x08000000)
+
+typedef struct {
+  volatile uint32_t ACR;
+  volatile uint32_t KEYR;
+  volatile uint32_t OPTKEYR;
+  volatile uint32_t SR;
+  volatile uint32_t CR;
+  volatile uint32_t AR;
+  volatile uint32_t RESERVED;
+  volatile uint32_t OBR;
+  volatile uint32_t WRPR;
+} FLASH_TypeDef;
+
+#define FLASH_SR_BSY                    ((uint32_t)0x00000001)
+#define FLASH_SR_PGERR                  ((uint32_t)0x00000004)
+#define FLASH_SR_WRPRTERR               ((uint32_t)0x00000010)
+#define FLASH_SR_EOP                    ((uint32_t)0x00000020)
+
+#define FLASH_CR_PG                     ((uint32_t)0x00000001)
+#define FLASH_CR_PER                    ((uint32_t)0x00000002)
+#define FLASH_CR_MER                    ((uint32_t)0x00000004)
+#define FLASH_CR_STRT                   ((uint32_t)0x00000040)
+#define FLASH_CR_LOCK                   ((uint32_t)0x00000080)
+#define FLASH_CR_ERRIE                  ((uint32_t)0x00000400)
+#define FLASH_CR_EOPIE                  ((uint32_t)0x00001000)
+
+#define FLASH_KEY1                      ((uint32_t)0x45670123)
+#define FLASH_KEY2                      ((uint32_t)0xCDEF89AB)
+
+/* The flash controller is modelled lazily: every access through FLASH
+   advances the simulated FPEC state machine before handing the registers
+   back. */
+FLASH_TypeDef *sim_flash_regs(void);
+#define FLASH                           (sim_flash_regs())
+
+typedef struct {
+  volatile uint32_t CR;
+  volatile uint32_t CFGR;
+  volatile uint32_t CIR;
+  volatile uint32_t APB2RSTR;
+  volatile uint32_t APB1RSTR;
+  volatile uint32_t AHBENR;
+  volatile uint32_t APB2ENR;
+  volatile uint32_t APB1ENR;
+  volatile uint32_t BDCR;
+  volatile uint32_t CSR;
+} RCC_TypeDef;
+
+#define RCC_CR_HSION                    ((uint32_t)0x00000001)
+#define RCC_CR_HSIRDY                   ((uint32_t)0x00000002)
+#define RCC_AHBENR_DMA1EN               ((uint32_t)0x00000001)
+#define RCC_AHBENR_CRCEN                ((uint32_t)0x00000040)
+#define RCC_APB1ENR_BKPEN               ((uint32_t)0x08000000)
+#define RCC_APB1ENR_PWREN               ((uint32_t)0x10000000)
+#define RCC_CSR_RMVF                    ((uint32_t)0x01000000)
+#define RCC_CSR_PINRSTF                 ((uint32_t)0x04000000)
+#define RCC_CSR_PORRSTF                 ((uint32_t)0x08000000)
+#define RCC_CSR_SFTRSTF                 ((uint32_t)0x10000000)
+
+extern RCC_TypeDef sim_rcc;
+#define RCC                             (&sim_rcc)
+
+#define rccEnableCRC(lp)                (RCC->AHBENR |= RCC_AHBENR_CRCEN)
+#define rccDisableCRC(lp)               (RCC->AHBENR &= ~RCC_AHBENR_CRCEN)
+
+typedef struct {
+  volatile uint32_t RESERVED0;
+  volatile uint32_t DR1;
+  volatile uint32_t DR2;
+  volatile uint32_t DR3;
+} BKP_TypeDef;
+
+extern BKP_TypeDef sim_bkp;
+#define BKP                             (&sim_bkp)
+
+typedef struct {
+  volatile uint32_t DR;
+  volatile uint8_t  IDR;
+  uint8_t           RESERVED0;
+  uint16_t          RESERVED1;
+  volatile uint32_t CR;
+} CRC_TypeDef;
+
+#define CRC_BASE                        ((uint32_t)0x40023000)
+#define CRC_CR_RESET                    ((uint32_t)0x00000001)
+
+/* The CRC unit sits at its real address, read-only: every store faults
+   and is folded into the CRC on the next access through CRC */
+CRC_TypeDef *sim_crc_regs(void);
+#define CRC                             (sim_crc_regs())
+
+typedef struct {
+  volatile uint32_t CCR;
+  volatile uint32_t CNDTR;
+  volatile uint32_t CPAR;
+  volatile uint32_t CMAR;
+} DMA_Channel_TypeDef;
+
+#define STM32_DMA_CR_EN                 ((uint32_t)0x00000001)
+#define STM32_DMA_CR_TCIE               ((uint32_t)0x00000002)
+#define STM32_DMA_CR_TEIE               ((uint32_t)0x00000008)
+#define STM32_DMA_CR_DIR_P2M            ((uint32_t)0x00000000)
+#define STM32_DMA_CR_DIR_M2P            ((uint32_t)0x00000010)
+#define STM32_DMA_CR_PINC               ((uint32_t)0x00000040)
+#define STM32_DMA_CR_MINC               ((uint32_t)0x00000080)
+#define STM32_DMA_CR_PSIZE_WORD         ((uint32_t)0x00000200)
+#define STM32_DMA_CR_MSIZE_WORD         ((uint32_t)0x00000800)
+#define STM32_DMA_CR_DIR_M2M            ((uint32_t)0x00004000)
+
+typedef void (*stm32_dmaisr_t)(void *p, uint32_t flags);
+
+typedef struct {
+  DMA_Channel_TypeDef *channel;
+  uint8_t selfindex;
+} stm32_dma_stream_t;
+
+/* Only DMA1 channel 1, and only memory to memory word transfers into the
+   CRC unit, done in one go when the channel is enabled */
+extern const stm32_dma_stream_t sim_dma1_stream1;
+#define STM32_DMA1_STREAM1              (&sim_dma1_stream1)
+
+bool dmaStreamAllocate(const stm32_dma_stream_t *dmastp, uint32_t priority, stm32_dmaisr_t func, void *param);
+void dmaStreamRelease(const stm32_dma_stream_t *dmastp);
+void dmaStreamEnable(const stm32_dma_stream_t *dmastp);
+void dmaStreamClearInterrupt(const stm32_dma_stream_t *dmastp);
+
+#define dmaStreamSetPeripheral(dmastp, addr) ((dmastp)->channel->CPAR = (uint32_t)(uintptr_t)(addr))
+#define dmaStreamSetMemory0(dmastp, addr) ((dmastp)->channel->CMAR = (uint32_t)(uintptr_t)(addr))
+#define dmaStreamSetTransactionSize(dmastp, size) ((dmastp)->channel->CNDTR = (uint32_t)(size))
+#define dmaStreamGetTransactionSize(dmastp) ((size_t)((dmastp)->channel->CNDTR))
+#define dmaStreamSetMode(dmastp, mode)  ((dmastp)->channel->CCR = (uint32_t)(mode))
+#define dmaStreamDisable(dmastp) do {                                       \
+  (dmastp)->channel->CCR &= ~(STM32_DMA_CR_TCIE | STM32_DMA_CR_TEIE | STM32_DMA_CR_EN); \
+  dmaStreamClearInterrupt(dmastp);                                          \
+} while (0)
+#define dmaWaitCompletion(dmastp) do {                                      \
+  while ((dmastp)->channel->CNDTR > 0U) {}                                  \
+  dmaStreamDisable(dmastp);                                                 \
+} while (0)
+
+typedef struct {
+  volatile uint32_t CR;
+  volatile uint32_t CSR;
+} PWR_TypeDef;
+
+#define PWR_CR_DBP                      ((uint32_t)0x00000100)
+
+extern PWR_TypeDef sim_pwr;
+#define PWR                             (&sim_pwr)
+
+void NVIC_SystemReset(void) __attribute__((noreturn));
+/* The application does not run in the simulator, handing it the stack
+   pointer ends the boot */
+void sim_app_entry(void) __attribute__((noreturn));
+#define __set_MSP(msp)                  ((void)(msp), sim_app_entry())
+#define __set_CONTROL(ctrl)             ((void)(ctrl))
+
+/*===========================================================================*/
+/* PAL                                                                       */
+/*===========================================================================*/
+
+typedef struct {
+  volatile uint32_t IDR;
+  volatile uint32_t ODR;
+} GPIO_TypeDef;
+
+typedef GPIO_TypeDef *ioportid_t;
+
+extern GPIO_TypeDef sim_gpioa, sim_gpioc;
+#define GPIOA                           (&sim_gpioa)
+#define GPIOC                           (&sim_gpioc)
+
+#define palReadPad(port, pad)           (((port)->IDR >> (pad)) & 1)
+#define palTogglePad(port, pad)         ((port)->ODR ^= 1U << (pad))
+#define palSetPad(port, pad)            ((port)->ODR |= 1U << (pad))
+#define palClearPad(port, pad)          ((port)->ODR &= ~(1U << (pad)))
+
+/*===========================================================================*/
+/* Serial                                                                    */
+/*===========================================================================*/
+
+typedef struct {
+  int                   fd;
+} BaseSequentialStream;
+
+typedef struct {
+  BaseSequentialStream  stream;
+} SerialDriver;
+
+extern SerialDriver SD2;
+
+void stm32_clock_init(void);
+void halInit(void);
+void sdStart(SerialDriver *sdp, const void *config);
+
+/*===========================================================================*/
+/* USB                                                                       */
+/*===========================================================================*/
+
+typedef uint8_t usbep_t;
+
+typedef enum {
+  USB_UNINIT   = 0,
+  USB_STOP     = 1,
+  USB_READY    = 2,
+  USB_SELECTED = 3,
+  USB_ACTIVE   = 4,
+  USB_SUSPENDED = 5
+} usbstate_t;
+
+typedef enum {
+  USB_EVENT_RESET = 0,
+  USB_EVENT_ADDRESS = 1,
+  USB_EVENT_CONFIGURED = 2,
+  USB_EVENT_UNCONFIGURED = 3,
+  USB_EVENT_SUSPEND = 4,
+  USB_EVENT_WAKEUP = 5,
+  USB_EVENT_STALLED = 6
+} usbevent_t;
+
+typedef struct USBDriver USBDriver;
+
+typedef struct {
+  size_t                ud_size;
+  const uint8_t         *ud_string;
+} USBDescriptor;
+
+typedef void (*usbcallback_t)(USBDriver *usbp);
+typedef void (*usbepcallback_t)(USBDriver *usbp, usbep_t ep);
+typedef void (*usbeventcb_t)(USBDriver *usbp, usbevent_t event);
+typedef bool (*usbreqhandler_t)(USBDriver *usbp);
+typedef const USBDescriptor * (*usbgetdescriptor_t)(USBDriver *usbp,
+                                                    uint8_t dtype,
+                                                    uint8_t dindex,
+                                                    uint16_t lang);
+
+typedef struct {
+  usbeventcb_t          event_cb;
+  usbgetdescriptor_t    get_descriptor_cb;
+  usbreqhandler_t       requests_hook_cb;
+  usbcallback_t         sof_cb;
+} USBConfig;
+
+typedef struct {
+  size_t                txsize;
+} USBInEndpointState;
+
+typedef struct {
+  size_t                rxsize;
+} USBOutEndpointState;
+
+typedef struct {
+  uint32_t              ep_mode;
+  usbepcallback_t       setup_cb;
+  usbepcallback_t       in_cb;
+  usbepcallback_t       out_cb;
+  uint16_t              in_maxsize;
+  uint16_t              out_maxsize;
+  USBInEndpointState    *in_state;
+  USBOutEndpointState   *out_state;
+  uint16_t              ep_buffers;
+  uint8_t               *setup_buf;
+} USBEndpointConfig;
+
+#define USB_MAX_ENDPOINTS               7
+
+struct USBDriver {
+  usbstate_t            state;
+  const USBConfig       *config;
+  const USBEndpointConfig *epc[USB_MAX_ENDPOINTS + 1];
+};
+
+extern USBDriver USBD1;
+
+#define USB_EP_MODE_TYPE                0x0003
+#define USB_EP_MODE_TYPE_CTRL           0x0000
+#define USB_EP_MODE_TYPE_ISOC           0x0001
+#define USB_EP_MODE_TYPE_BULK           0x0002
+#define USB_EP_MODE_TYPE_INTR           0x0003
+
+#define USB_DESCRIPTOR_DEVICE           1
+#define USB_DESCRIPTOR_CONFIGURATION    2
+#define USB_DESCRIPTOR_STRING           3
+#define USB_DESCRIPTOR_INTERFACE        4
+#define USB_DESCRIPTOR_ENDPOINT         5
+
+#define USB_DESC_BYTE(b) ((uint8_t)(b))
+#define USB_DESC_WORD(w)                                                    \
+  (uint8_t)((w) & 255),                                                     \
+  (uint8_t)(((w) >> 8) & 255)
+#define USB_DESC_BCD(bcd)                                                   \
+  (uint8_t)((bcd) & 255),                                                   \
+  (uint8_t)(((bcd) >> 8) & 255)
+#define USB_DESC_DEVICE(bcdUSB, bDeviceClass, bDeviceSubClass,              \
+                        bDeviceProtocol, bMaxPacketSize, idVendor,          \
+                        idProduct, bcdDevice, iManufacturer,                \
+                        iProduct, iSerialNumber, bNumConfigurations)        \
+  USB_DESC_BYTE(18),                                                        \
+  USB_DESC_BYTE(USB_DESCRIPTOR_DEVICE),                                     \
+  USB_DESC_BCD(bcdUSB),                                                     \
+  USB_DESC_BYTE(bDeviceClass),                                              \
+  USB_DESC_BYTE(bDeviceSubClass),                                           \
+  USB_DESC_BYTE(bDeviceProtocol),                                           \
+  USB_DESC_BYTE(bMaxPacketSize),                                            \
+  USB_DESC_WORD(idVendor),                                                  \
+  USB_DESC_WORD(idProduct),                                                 \
+  USB_DESC_BCD(bcdDevice),                                                  \
+  USB_DESC_BYTE(iManufacturer),                                             \
+  USB_DESC_BYTE(iProduct),                                                  \
+  USB_DESC_BYTE(iSerialNumber),                                             \
+  USB_DESC_BYTE(bNumConfigurations)
+#define USB_DESC_CONFIGURATION(wTotalLength, bNumInterfaces,                \
+                               bConfigurationValue, iConfiguration,         \
+                               bmAttributes, bMaxPower)                     \
+  USB_DESC_BYTE(9),                                                         \
+  USB_DESC_BYTE(USB_DESCRIPTOR_CONFIGURATION),                              \
+  USB_DESC_WORD(wTotalLength),                                              \
+  USB_DESC_BYTE(bNumInterfaces),                                            \
+  USB_DESC_BYTE(bConfigurationValue),                                       \
+  USB_DESC_BYTE(iConfiguration),                                            \
+  USB_DESC_BYTE(bmAttributes),                                              \
+  USB_DESC_BYTE(bMaxPower)
+#define USB_DESC_INTERFACE(bInterfaceNumber, bAlternateSetting,             \
+                           bNumEndpoints, bInterfaceClass,                  \
+                           bInterfaceSubClass, bInterfaceProtocol,          \
+                           iInterface)                                      \
+  USB_DESC_BYTE(9),                                                         \
+  USB_DESC_BYTE(USB_DESCRIPTOR_INTERFACE),                                  \
+  USB_DESC_BYTE(bInterfaceNumber),                                          \
+  USB_DESC_BYTE(bAlternateSetting),                                         \
+  USB_DESC_BYTE(bNumEndpoints),                                             \
+  USB_DESC_BYTE(bInterfaceClass),                                           \
+  USB_DESC_BYTE(bInterfaceSubClass),                                        \
+  USB_DESC_BYTE(bInterfaceProtocol),                                        \
+  USB_DESC_BYTE(iInterface)
+#define USB_DESC_ENDPOINT(bEndpointAddress, bmAttributes, wMaxPacketSize,   \
+                          bInterval)                                        \
+  USB_DESC_BYTE(7),                                                         \
+  USB_DESC_BYTE(USB_DESCRIPTOR_ENDPOINT),                                   \
+  USB_DESC_BYTE(bEndpointAddress),                                          \
+  USB_DESC_BYTE(bmAttributes),                                              \
+  USB_DESC_WORD(wMaxPacketSize),                                            \
+  USB_DESC_BYTE(bInterval)
+
+void usbStart(USBDriver *usbp, const USBConfig *config);
+void usbConnectBus(USBDriver *usbp);
+void usbDisconnectBus(USBDriver *usbp);
+void usbInitEndpointI(USBDriver *usbp, usbep_t ep, const USBEndpointConfig *epcp);
+msg_t usbReceive(USBDriver *usbp, usbep_t ep, uint8_t *buf, size_t n);
+msg_t usbTransmit(USBDriver *usbp, usbep_t ep, const uint8_t *buf, size_t n);
+
+#endif /* _SIM_HAL_H_ */
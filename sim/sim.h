@@ -0,0 +1,55 @@
+/*
+ * Copyright (C) 2017 https://www.brobwind.com
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef __SIM_H__
+#define __SIM_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define SIM_FLASH_SIZE                  (128 * 1024)
+#define SIM_FLASH_PAGE_SIZE             1024
+#define SIM_SYSMEM_BASE                 0x1FFFF000
+#define SIM_USB_PACKET_SIZE             64
+
+typedef struct {
+    const char *flash_path;     /* Backing file of the on-chip flash */
+    int blank;                  /* Start from an all-erased flash */
+    uint32_t erase_us;          /* Page erase time */
+    uint32_t program_us;        /* Half-word programming time */
+    int flash_overlap;          /* Threads keep running while the flash is busy */
+    uint32_t usb_packet_us;     /* Bus time of one 64 bytes bulk packet */
+    int usb_double_buffer;      /* OUT endpoints take a packet while the last one is read */
+    uint32_t clock_init_us;     /* stm32_clock_init(): HSE start-up and PLL lock */
+    int power_on;               /* Boot from a power on reset instead of the DFU exit */
+} sim_config_t;
+
+extern sim_config_t sim_config;
+
+uint64_t sim_now_us(void);
+
+int sim_init(void);
+void sim_boot(int (*entry)(void));
+int sim_wait_reset(uint32_t timeout_ms);
+/* Time from sim_boot() to the application getting its stack pointer */
+int sim_wait_app(uint32_t timeout_ms, uint64_t *us);
+
+/* Host side of the bulk endpoints */
+void sim_usb_wait_active(void);
+void sim_usb_host_write(uint8_t ep, const uint8_t *buf, size_t n);
+int sim_usb_host_read(uint8_t ep, uint8_t *buf, size_t n, uint32_t timeout_ms);
+
+#endif
@@ -0,0 +1,808 @@
+/*
+ * Copyright (C) 2017 https://www.brobwind.com
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Host side of the simulator: boots the bootloader and replays a firmware
+ * upload through the vendor protocol, the way the ST-LINK upgrade tool
+ * does it, then reports throughput and checks the flash contents.
+ */
+
+#include <fcntl.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "hal.h"
+
+#include "usbcfg.h"
+#include "bro_aes.h"
+
+#include "sim.h"
+
+
+#define DFU_CHUNK_SIZE                  1024
+#define DFU_LZ_MAX_SIZE                 (8 * 1024)
+#define DFU_OP_TIMEOUT_MS               5000
+
+int bdlink_main(void);
+
+static int poll_wait = 1;
+static int send_erase = 1;
+static int range_erase = 0;
+static int show_stats = 0;
+static int show_profile = 0;
+static int show_trace = 0;
+static int app_boot = 0;
+static int verify_crc = 0;
+static int read_back = 0;
+static int compress = 0;
+static uint32_t bulk_size = 0;
+
+static void host_sleep_ms(uint32_t msec) {
+    struct timespec ts = {
+        .tv_sec  = msec / 1000,
+        .tv_nsec = (msec % 1000) * 1000000,
+    };
+
+    nanosleep(&ts, NULL);
+}
+
+static int host_request(const uint8_t *req, uint8_t *rsp, size_t len) {
+    uint8_t cmd[16];
+
+    memset(cmd, 0x00, sizeof(cmd));
+    memcpy(cmd, req, 4);
+    sim_usb_host_write(USBD1_STLINK_RX_EP, cmd, sizeof(cmd));
+
+    return len == 0 ? 0 : sim_usb_host_read(USBD1_STLINK_TX_EP, rsp, len, DFU_OP_TIMEOUT_MS);
+}
+
+/* GETSTATUS until the bootloader is idle again */
+static const char *dfu_status_name(uint8_t status) {
+    switch (status) {
+    case 0x01: return "errTARGET";
+    case 0x03: return "errWRITE";
+    case 0x04: return "errERASE";
+    case 0x05: return "errCHECK_ERASED";
+    case 0x07: return "errVERIFY";
+    case 0x08: return "errADDRESS";
+    case 0x0e: return "errUNKNOWN";
+    default: return "?";
+    }
+}
+
+static int dfu_wait_idle(void) {
+    uint64_t start = sim_now_us();
+    uint8_t rsp[6];
+
+    while (sim_now_us() - start < DFU_OP_TIMEOUT_MS * 1000ULL) {
+        if (host_request((const uint8_t *)"\xf3\x03\x00\x00", rsp, sizeof(rsp)) != sizeof(rsp)) {
+            return -1;
+        }
+
+        if (rsp[4] == 0x05) { // dfuDNLOAD-IDLE
+            return 0;
+        }
+        if (rsp[4] == 0x0a) { // dfuERROR
+            fprintf(stderr, "dfuERROR, status 0x%02x (%s)\n", rsp[0], dfu_status_name(rsp[0]));
+            return -1;
+        }
+        if (rsp[4] != 0x04) { // dfuDNBUSY
+            return -1;
+        }
+
+        if (poll_wait) {
+            host_sleep_ms(rsp[1] | rsp[2] << 8 | rsp[3] << 16);
+        }
+    }
+
+    return -1;
+}
+
+static uint16_t dfu_checksum(const uint8_t *data, uint16_t len) {
+    uint16_t checksum, idx;
+
+    for (idx = 0, checksum = 0; idx < len; idx++) {
+        checksum += data[idx];
+    }
+
+    return checksum;
+}
+
+/* The checksum is taken over the plain text, size is the decompressed
+   size of an LZ4 payload (format 1) */
+static int dfu_download_format(uint16_t seq, uint16_t checksum, const uint8_t *data, uint16_t len,
+        uint8_t format, uint16_t size) {
+    uint8_t hdr[16];
+
+    memset(hdr, 0x00, sizeof(hdr));
+    hdr[0] = 0xf3;
+    hdr[1] = 0x01;
+    hdr[2] = (seq >> 0) & 0xff;
+    hdr[3] = (seq >> 8) & 0xff;
+    hdr[4] = (checksum >> 0) & 0xff;
+    hdr[5] = (checksum >> 8) & 0xff;
+    hdr[6] = (len >> 0) & 0xff;
+    hdr[7] = (len >> 8) & 0xff;
+    hdr[8] = format;
+    hdr[10] = (size >> 0) & 0xff;
+    hdr[11] = (size >> 8) & 0xff;
+
+    sim_usb_host_write(USBD1_STLINK_RX_EP, hdr, sizeof(hdr));
+    sim_usb_host_write(USBD1_STLINK_RX_EP, data, len);
+
+    return dfu_wait_idle();
+}
+
+static int dfu_download(uint16_t seq, uint16_t checksum, const uint8_t *data, uint16_t len) {
+    return dfu_download_format(seq, checksum, data, len, 0, 0);
+}
+
+/* One LZ4 sequence: literals, then a match unless mlen is 0 */
+static size_t lz4_sequence(uint8_t *dst, size_t op, size_t cap, const uint8_t *lit, size_t llen,
+        size_t offset, size_t mlen) {
+    uint8_t *token = dst + op;
+    size_t n;
+
+    if (op + 1 + llen / 255 + 1 + llen + 2 + (mlen / 255 + 1) > cap) {
+        return SIZE_MAX;
+    }
+
+    op++;
+    *token = (llen < 15 ? llen : 15) << 4;
+    for (n = llen >= 15 ? llen - 15 : SIZE_MAX; n != SIZE_MAX; n = n >= 255 ? n - 255 : SIZE_MAX) {
+        dst[op++] = n >= 255 ? 255 : n;
+    }
+    memcpy(dst + op, lit, llen);
+    op += llen;
+
+    if (mlen != 0) {
+        dst[op++] = (offset >> 0) & 0xff;
+        dst[op++] = (offset >> 8) & 0xff;
+        mlen -= 4;
+        *token |= mlen < 15 ? mlen : 15;
+        for (n = mlen >= 15 ? mlen - 15 : SIZE_MAX; n != SIZE_MAX; n = n >= 255 ? n - 255 : SIZE_MAX) {
+            dst[op++] = n >= 255 ? 255 : n;
+        }
+    }
+
+    return op;
+}
+
+/* Greedy LZ4 block, SIZE_MAX when it does not fit in cap */
+static size_t lz4_compress(const uint8_t *src, size_t len, uint8_t *dst, size_t cap) {
+    static uint32_t table[4096];
+    size_t ip = 0, anchor = 0, op = 0;
+
+    memset(table, 0x00, sizeof(table));
+    while (ip + 4 <= len && op != SIZE_MAX) {
+        uint32_t seq, h;
+        size_t ref, mlen;
+
+        memcpy(&seq, src + ip, 4);
+        h = (seq * 2654435761U) >> 20;
+        ref = table[h];
+        table[h] = ip + 1;
+        if (ref == 0 || memcmp(src + ref - 1, src + ip, 4) != 0) {
+            ip++;
+            continue;
+        }
+        ref--;
+
+        for (mlen = 4; ip + mlen < len && src[ref + mlen] == src[ip + mlen]; mlen++) {
+        }
+        op = lz4_sequence(dst, op, cap, src + anchor, ip - anchor, ip - ref, mlen);
+        ip += mlen;
+        anchor = ip;
+    }
+
+    return op == SIZE_MAX ? op : lz4_sequence(dst, op, cap, src + anchor, len - anchor, 0, 0);
+}
+
+static int dfu_command(uint8_t cmd, uint32_t addr) {
+    uint8_t data[5] = {
+        cmd,
+        (addr >>  0) & 0xff, (addr >>  8) & 0xff,
+        (addr >> 16) & 0xff, (addr >> 24) & 0xff
+    };
+
+    return dfu_download(0, dfu_checksum(data, sizeof(data)), data, sizeof(data));
+}
+
+/* One request for count pages from addr */
+static int dfu_erase_range(uint32_t addr, uint16_t count) {
+    uint8_t data[7] = {
+        0x41,
+        (addr >>  0) & 0xff, (addr >>  8) & 0xff,
+        (addr >> 16) & 0xff, (addr >> 24) & 0xff,
+        (count >> 0) & 0xff, (count >> 8) & 0xff
+    };
+
+    return dfu_download(0, dfu_checksum(data, sizeof(data)), data, sizeof(data));
+}
+
+/* CRC-32 as the STM32 CRC unit computes it, over little endian words */
+static uint32_t crc32_words(const uint8_t *data, size_t len) {
+    uint32_t crc = 0xffffffff;
+    size_t idx;
+    int bit;
+
+    for (idx = 0; idx + 4 <= len; idx += 4) {
+        crc ^= data[idx] | data[idx + 1] << 8 | data[idx + 2] << 16 | (uint32_t)data[idx + 3] << 24;
+        for (bit = 0; bit < 32; bit++) {
+            crc = crc & 0x80000000 ? (crc << 1) ^ 0x04c11db7 : crc << 1;
+        }
+    }
+
+    return crc;
+}
+
+/* 0xf3 0x83: the device CRC of what was written, padding included */
+static int dfu_verify_crc(uint32_t addr, const uint8_t *image, size_t size) {
+    size_t len = (size + 15) & ~(size_t)15;
+    uint8_t hdr[16], rsp[8], *padded = malloc(len);
+    uint32_t crc, expected;
+    uint64_t t0;
+
+    memset(padded, 0xff, len);
+    memcpy(padded, image, size);
+    expected = crc32_words(padded, len);
+    free(padded);
+
+    memset(hdr, 0x00, sizeof(hdr));
+    hdr[0] = 0xf3;
+    hdr[1] = 0x83;
+    memcpy(hdr + 2, &addr, 4);
+    hdr[6] = (len >>  0) & 0xff;
+    hdr[7] = (len >>  8) & 0xff;
+    hdr[8] = (len >> 16) & 0xff;
+    hdr[9] = (len >> 24) & 0xff;
+
+    t0 = sim_now_us();
+    sim_usb_host_write(USBD1_STLINK_RX_EP, hdr, sizeof(hdr));
+    if (sim_usb_host_read(USBD1_STLINK_TX_EP, rsp, sizeof(rsp), DFU_OP_TIMEOUT_MS) != sizeof(rsp)) {
+        fprintf(stderr, "no reply to the CRC command\n");
+        return -1;
+    }
+    memcpy(&crc, rsp, 4);
+
+    printf("crc:        %08x, device %08x (status 0x%02x) in %.3f ms, %s\n", expected, crc, rsp[4],
+        (sim_now_us() - t0) / 1e3, rsp[4] == 0 && crc == expected ? "match" : "MISMATCH");
+
+    return rsp[4] == 0 && crc == expected ? 0 : -1;
+}
+
+/*
+ * 0xf3 0x84: reads the image back from 100 bytes before it, the part of
+ * them in the bootloader area has to come back as 0xff.
+ */
+static int dfu_read_back(uint32_t addr, const uint8_t *image, size_t size) {
+    const uint32_t masked = 100;
+    uint32_t len = size + masked, got = 0, idx;
+    uint8_t hdr[16], *data = malloc(len);
+    uint64_t t0;
+    int n, ok = 1;
+
+    memset(hdr, 0x00, sizeof(hdr));
+    hdr[0] = 0xf3;
+    hdr[1] = 0x84;
+    hdr[2] = ((addr - masked) >>  0) & 0xff;
+    hdr[3] = ((addr - masked) >>  8) & 0xff;
+    hdr[4] = ((addr - masked) >> 16) & 0xff;
+    hdr[5] = ((addr - masked) >> 24) & 0xff;
+    memcpy(hdr + 6, &len, 4);
+
+    t0 = sim_now_us();
+    sim_usb_host_write(USBD1_STLINK_RX_EP, hdr, sizeof(hdr));
+    while (got < len) {
+        n = sim_usb_host_read(USBD1_STLINK_TX_EP, data + got, len - got, DFU_OP_TIMEOUT_MS);
+        if (n <= 0) {
+            break;
+        }
+        got += n;
+    }
+
+    for (idx = 0; idx < got; idx++) {
+        uint32_t a = addr - masked + idx;
+        uint8_t expected = idx >= masked ? image[idx - masked] :
+            a < 0x08004000 ? 0xff : *(volatile uint8_t *)(uintptr_t)a;
+
+        if (data[idx] != expected) {
+            ok = 0;
+            break;
+        }
+    }
+    free(data);
+
+    printf("read back:  %u of %u bytes in %.3f ms, %.1f KB/s, %s\n", got, len,
+        (sim_now_us() - t0) / 1e3, got / 1024.0 / ((sim_now_us() - t0) / 1e6),
+        ok && got == len ? "match" : "MISMATCH");
+
+    return ok && got == len ? 0 : -1;
+}
+
+/* Same derivation as the bootloader: the host side knows the device UID */
+static void derive_key(AES_KEY *key) {
+    const uint8_t salt[] = {
+        0x29, 0xf1, 0x95, 0x64, 0xcc, 0xdb, 0xde, 0xf9,
+        0x3b, 0xd1, 0xe7, 0x7d, 0x8a, 0x89, 0xb9, 0xbf
+    };
+    uint8_t devuid[16] = {
+        0x80, 0x00, 0xff, 0xff,
+        'b', 'r', 'o', 'b',
+        'w', 'i', 'n', 'd',
+        '.', 'c', 'o', 'm'
+    };
+    uint8_t enckey[16];
+
+    AES_set_decrypt_key(devuid, 128, key);
+    AES_decrypt(salt, enckey, key);
+
+    AES_set_encrypt_key(enckey, 128, key);
+    memcpy(devuid + 4, (void *)(SIM_SYSMEM_BASE + 0x7e8), 12);
+    AES_encrypt(devuid, enckey, key);
+    AES_set_encrypt_key(enckey, 128, key);
+}
+
+/* Code-like random data, a zero filled table and 0xff padding */
+/* Vector table at the application base and the magic value in the last
+   word of the flash: the bootloader starts it from a power on reset */
+static int write_app_stub(void) {
+    static const uint32_t vectors[2] = { 0x20005000, 0x08004101 };
+    static const uint32_t magic = 0xa50027d3;
+    int fd = open(sim_config.flash_path, O_WRONLY);
+
+    if (fd < 0 || pwrite(fd, vectors, sizeof(vectors), 0x4000) != sizeof(vectors) ||
+            pwrite(fd, &magic, sizeof(magic), SIM_FLASH_SIZE - sizeof(magic)) != sizeof(magic)) {
+        perror(sim_config.flash_path);
+        return -1;
+    }
+    close(fd);
+
+    return 0;
+}
+
+static uint8_t *make_image(size_t size) {
+    uint8_t *image = malloc(size);
+    uint32_t x = 0x2545f491;
+    size_t i;
+
+    for (i = 0; i < size; i++) {
+        if (i < size * 3 / 4) {
+            x ^= x << 13;
+            x ^= x >> 17;
+            x ^= x << 5;
+            image[i] = x & 0xff;
+        } else if (i < size * 7 / 8) {
+            image[i] = 0x00;
+        } else {
+            image[i] = 0xff;
+        }
+    }
+
+    return image;
+}
+
+static uint8_t *load_image(const char *path, size_t *size) {
+    uint8_t *image;
+    FILE *fp;
+    long len;
+
+    fp = fopen(path, "rb");
+    if (fp == NULL || fseek(fp, 0, SEEK_END) != 0 || (len = ftell(fp)) <= 0) {
+        perror(path);
+        return NULL;
+    }
+    rewind(fp);
+
+    image = malloc(len);
+    if (fread(image, 1, len, fp) != (size_t)len) {
+        perror(path);
+        fclose(fp);
+        free(image);
+        return NULL;
+    }
+    fclose(fp);
+
+    *size = len;
+
+    return image;
+}
+
+/* 0xf3 0x80: hits and handling time per vendor command */
+static void print_stats(void) {
+    uint8_t rsp[256], *p;
+    int len, idx;
+
+    len = host_request((const uint8_t *)"\xf3\x80\x00\x00", rsp, sizeof(rsp));
+    if (len < 8 || len < 8 + rsp[0] * 10) {
+        fprintf(stderr, "no command statistics\n");
+        return;
+    }
+
+    printf("commands:   %u unknown\n", rsp[4] | rsp[5] << 8 | rsp[6] << 16 | (uint32_t)rsp[7] << 24);
+    for (idx = 0, p = rsp + 8; idx < rsp[0]; idx++, p += 10) {
+        uint32_t hits = p[2] | p[3] << 8 | p[4] << 16 | (uint32_t)p[5] << 24;
+        uint32_t us = p[6] | p[7] << 8 | p[8] << 16 | (uint32_t)p[9] << 24;
+
+        if (hits != 0) {
+            printf("  %02x %02x    %6u hits, %10.3f ms, %8.1f us each\n",
+                p[0], p[1], hits, us / 1e3, (double)us / hits);
+        }
+    }
+}
+
+/* 0xf3 0x82: cycles spent in each stage of the update path, cleared once read */
+static void print_profile(void) {
+    static const char *stages[] = {
+        "usb header", "usb payload", "key", "decrypt",
+        "checksum", "erase", "program", "status"
+    };
+    uint8_t rsp[256], *p;
+    uint32_t mhz;
+    int len, idx;
+
+    len = host_request((const uint8_t *)"\xf3\x82\x01\x00", rsp, sizeof(rsp));
+    if (len < 4 || len < 4 + rsp[0] * 20) {
+        fprintf(stderr, "no update profile\n");
+        return;
+    }
+
+    mhz = rsp[2] | rsp[3] << 8;
+    printf("profile:    %u MHz cycle counter\n", mhz);
+    for (idx = 0, p = rsp + 4; idx < rsp[0]; idx++, p += 20) {
+        uint32_t min, max, count;
+        uint64_t sum;
+
+        memcpy(&min, p, 4);
+        memcpy(&max, p + 4, 4);
+        memcpy(&sum, p + 8, 8);
+        memcpy(&count, p + 16, 4);
+        if (count != 0) {
+            printf("  %-11s %6u x, %10.3f ms, min %8.1f us, avg %8.1f us, max %8.1f us\n",
+                idx < (int)(sizeof(stages) / sizeof(stages[0])) ? stages[idx] : "?",
+                count, sum / (mhz * 1e3), (double)min / mhz, (double)sum / count / mhz,
+                (double)max / mhz);
+        }
+    }
+}
+
+/* Telemetry records from the trace endpoint, printed as they come */
+static volatile int trace_stop = 0;
+
+static void *trace_reader(void *arg) {
+    static const char *events[] = {
+        "?", "usb reset", "chunk", "erase start", "erase done", "program done", "checksum fail"
+    };
+    uint8_t pkt[64], *p;
+    uint32_t t0 = 0;
+    int len, first = 1;
+
+    (void)arg;
+
+    while (true) {
+        len = sim_usb_host_read(USBD1_STLINK_TRACE_EP, pkt, sizeof(pkt), 20);
+        if (len < 0) {
+            if (trace_stop) {
+                break;
+            }
+            continue;
+        }
+
+        for (p = pkt; p + 8 <= pkt + len; p += 8) {
+            uint32_t time = p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24;
+            uint16_t value = p[6] | p[7] << 8;
+
+            if (first) {
+                t0 = time;
+                first = 0;
+            }
+            printf("trace:      %10.3f ms  %-13s %3u %5u\n", (uint32_t)(time - t0) / (STM32_HCLK / 1e3),
+                p[4] == 0x7f ? "dropped" : p[4] < sizeof(events) / sizeof(events[0]) ? events[p[4]] : "?",
+                p[5], value);
+        }
+    }
+
+    return NULL;
+}
+
+/* 0xf3 0x81: stream size bytes into the bulk OUT endpoint, nothing else */
+static int bulk_sink(uint32_t size) {
+    uint8_t hdr[16], rsp[8], *data = calloc(1, size);
+    uint64_t t0, elapsed;
+    uint32_t done, us;
+
+    memset(hdr, 0x00, sizeof(hdr));
+    hdr[0] = 0xf3;
+    hdr[1] = 0x81;
+    hdr[2] = (size >>  0) & 0xff;
+    hdr[3] = (size >>  8) & 0xff;
+    hdr[4] = (size >> 16) & 0xff;
+    hdr[5] = (size >> 24) & 0xff;
+
+    t0 = sim_now_us();
+    sim_usb_host_write(USBD1_STLINK_RX_EP, hdr, sizeof(hdr));
+    sim_usb_host_write(USBD1_STLINK_RX_EP, data, size);
+    elapsed = sim_now_us() - t0;
+    free(data);
+
+    if (sim_usb_host_read(USBD1_STLINK_TX_EP, rsp, sizeof(rsp), DFU_OP_TIMEOUT_MS) != sizeof(rsp)) {
+        fprintf(stderr, "no reply to the bulk sink command\n");
+        return -1;
+    }
+    memcpy(&done, rsp, 4);
+    memcpy(&us, rsp + 4, 4);
+
+    printf("bulk out:   %u bytes, host %.1f KB/s, device %.1f KB/s\n", done,
+        size / 1024.0 / (elapsed / 1e6), done / 1024.0 / (us / 1e6));
+
+    return done == size ? 0 : -1;
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr,
+        "Usage: %s [options] [image.bin]\n"
+        "  -f FILE   flash backing file (default %s)\n"
+        "  -E        start from an erased flash\n"
+        "  -a ADDR   load address (default 0x08004000)\n"
+        "  -s SIZE   size of the generated image when none is given (default 102400)\n"
+        "  -e USEC   page erase time (default %u)\n"
+        "  -p USEC   half-word programming time (default %u)\n"
+        "  -O        let the other threads run while the flash is busy\n"
+        "  -u USEC   bus time of a 64 bytes bulk packet (default %u)\n"
+        "  -D        model double buffered bulk OUT endpoints\n"
+        "  -H USEC   HSE start-up and PLL lock time (default %u)\n"
+        "  -A        only measure power on reset to application entry\n"
+        "  -n        do not honour the poll timeout of the status reply\n"
+        "  -N        do not erase the pages before programming them\n"
+        "  -R        erase all pages of the image with one range erase\n"
+        "  -S        print the per-command statistics of the bootloader\n"
+        "  -P        print the time spent in each stage of the update\n"
+        "  -T        print the telemetry records of the trace endpoint\n"
+        "  -V        verify the image with the CRC computed by the bootloader\n"
+        "  -r        read the image back over the bulk IN endpoint\n"
+        "  -z        send LZ4 compressed chunks of up to 8 KB\n"
+        "  -B SIZE   only measure raw bulk OUT throughput with SIZE bytes\n",
+        prog, sim_config.flash_path, sim_config.erase_us, sim_config.program_us,
+        sim_config.usb_packet_us, sim_config.clock_init_us);
+}
+
+int main(int argc, char *argv[]) {
+    uint32_t base = 0x08004000;
+    size_t size = 100 * 1024, off;
+    uint64_t start, elapsed, lat, lat_min = UINT64_MAX, lat_max = 0, lat_sum = 0;
+    uint32_t chunks = 0;
+    uint8_t *image, rsp[6], chunk[DFU_CHUNK_SIZE], enc[DFU_CHUNK_SIZE], lz[DFU_CHUNK_SIZE];
+    uint8_t hdr[16], status[20];
+    uint32_t skipped = 0, noerase = 0, wire = 0, dev_wire = 0, dev_image = 0;
+    size_t step;
+    AES_KEY key;
+    pthread_t trace_tid;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "f:Ea:s:e:p:Ou:DH:AnNRSPTVrzB:h")) != -1) {
+        switch (opt) {
+        case 'f': sim_config.flash_path = optarg; break;
+        case 'E': sim_config.blank = 1; break;
+        case 'a': base = strtoul(optarg, NULL, 0); break;
+        case 's': size = strtoul(optarg, NULL, 0); break;
+        case 'e': sim_config.erase_us = strtoul(optarg, NULL, 0); break;
+        case 'p': sim_config.program_us = strtoul(optarg, NULL, 0); break;
+        case 'O': sim_config.flash_overlap = 1; break;
+        case 'u': sim_config.usb_packet_us = strtoul(optarg, NULL, 0); break;
+        case 'D': sim_config.usb_double_buffer = 1; break;
+        case 'H': sim_config.clock_init_us = strtoul(optarg, NULL, 0); break;
+        case 'A': app_boot = 1; break;
+        case 'n': poll_wait = 0; break;
+        case 'N': send_erase = 0; break;
+        case 'R': range_erase = 1; break;
+        case 'S': show_stats = 1; break;
+        case 'P': show_profile = 1; break;
+        case 'T': show_trace = 1; break;
+        case 'V': verify_crc = 1; break;
+        case 'r': read_back = 1; break;
+        case 'z': compress = 1; break;
+        case 'B': bulk_size = strtoul(optarg, NULL, 0); break;
+        default:
+            usage(argv[0]);
+            return opt == 'h' ? EXIT_SUCCESS : EXIT_FAILURE;
+        }
+    }
+
+    image = optind < argc ? load_image(argv[optind], &size) : make_image(size);
+    if (image == NULL) {
+        return EXIT_FAILURE;
+    }
+    if (base < 0x08004000 || base + size > 0x08000000 + SIM_FLASH_SIZE) {
+        fprintf(stderr, "image does not fit in the application area\n");
+        return EXIT_FAILURE;
+    }
+
+    if (sim_init() < 0) {
+        return EXIT_FAILURE;
+    }
+
+    if (app_boot) {
+        uint64_t us;
+
+        sim_config.power_on = 1;
+        if (write_app_stub() < 0) {
+            return EXIT_FAILURE;
+        }
+        sim_boot(bdlink_main);
+        if (sim_wait_app(DFU_OP_TIMEOUT_MS, &us) < 0) {
+            fprintf(stderr, "bootloader did not start the application\n");
+            return EXIT_FAILURE;
+        }
+        printf("app entry:  %.1f us after reset\n", (double)us);
+        return EXIT_SUCCESS;
+    }
+
+    sim_boot(bdlink_main);
+    sim_usb_wait_active();
+
+    if (host_request((const uint8_t *)"\xf1\x80\x00\x00", rsp, 6) != 6) {
+        fprintf(stderr, "no reply from the bootloader\n");
+        return EXIT_FAILURE;
+    }
+    printf("bootloader: version %02x%02x, %04x:%04x\n", rsp[1], rsp[0],
+        rsp[2] | rsp[3] << 8, rsp[4] | rsp[5] << 8);
+    host_request((const uint8_t *)"\xf5\x00\x00\x00", rsp, 2);
+
+    if (bulk_size != 0) {
+        return bulk_sink(bulk_size) < 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+    }
+
+    if (show_trace) {
+        pthread_create(&trace_tid, NULL, trace_reader, NULL);
+    }
+
+    derive_key(&key);
+
+    start = sim_now_us();
+    if (send_erase && range_erase) {
+        uint16_t pages = ((base & (DFU_CHUNK_SIZE - 1)) + size + DFU_CHUNK_SIZE - 1) / DFU_CHUNK_SIZE;
+
+        if (dfu_erase_range(base & ~(DFU_CHUNK_SIZE - 1), pages) < 0) {
+            fprintf(stderr, "range erase failed at 0x%08x\n", base);
+            return EXIT_FAILURE;
+        }
+        printf("erase:      %u pages in %.3f s\n", pages, (sim_now_us() - start) / 1e6);
+    }
+    for (off = 0; off < size; off += step) {
+        uint32_t addr = base + off, page;
+        uint16_t len = size - off < DFU_CHUNK_SIZE ? size - off : DFU_CHUNK_SIZE;
+        uint64_t t0 = sim_now_us();
+        uint8_t format = 0;
+
+        memset(chunk, 0xff, sizeof(chunk));
+        memcpy(chunk, image + off, len);
+
+        /* The largest run of pages that still compresses into a chunk */
+        for (step = compress ? DFU_LZ_MAX_SIZE : 0; step > DFU_CHUNK_SIZE / 2; step /= 2) {
+            size_t n = size - off < step ? size - off : step;
+            size_t clen = lz4_compress(image + off, n, lz, DFU_CHUNK_SIZE);
+
+            if (clen < n) {
+                memset(chunk, 0x00, sizeof(chunk));
+                memcpy(chunk, lz, clen);
+                len = clen;
+                step = n;
+                format = 1;
+                break;
+            }
+        }
+        if (format == 0) {
+            step = len;
+        }
+        len = (len + 15) & ~15;
+        wire += len;
+
+        /* Every page the chunk covers */
+        for (page = addr & ~(DFU_CHUNK_SIZE - 1); send_erase && !range_erase && page < addr + step;
+                page += DFU_CHUNK_SIZE) {
+            if (dfu_command(0x41, page < addr ? addr : page) < 0) {
+                fprintf(stderr, "erase failed at 0x%08x\n", page);
+                return EXIT_FAILURE;
+            }
+        }
+        if (dfu_command(0x21, addr) < 0) {
+            fprintf(stderr, "command failed at 0x%08x\n", addr);
+            return EXIT_FAILURE;
+        }
+
+        AES_encrypt_blocks(chunk, enc, len / 16, &key);
+        if (dfu_download_format(2, dfu_checksum(chunk, len), enc, len, format, format ? step : 0) < 0) {
+            fprintf(stderr, "download failed at 0x%08x\n", addr);
+            return EXIT_FAILURE;
+        }
+
+        lat = sim_now_us() - t0;
+        lat_sum += lat;
+        lat_min = lat < lat_min ? lat : lat_min;
+        lat_max = lat > lat_max ? lat : lat_max;
+        chunks++;
+    }
+
+    /* Asked once more the bootloader answers when the queued chunks are
+       programmed, with how they went */
+    if (dfu_wait_idle() < 0) {
+        fprintf(stderr, "update failed after %u chunks\n", chunks);
+        return EXIT_FAILURE;
+    }
+    elapsed = sim_now_us() - start;
+
+    /* Long status: pages skipped and programmed without an erase, bytes
+       received and programmed */
+    memset(hdr, 0x00, sizeof(hdr));
+    memcpy(hdr, "\xf3\x03", 2);
+    hdr[6] = 20;
+    sim_usb_host_write(USBD1_STLINK_RX_EP, hdr, sizeof(hdr));
+    if (sim_usb_host_read(USBD1_STLINK_TX_EP, status, sizeof(status), DFU_OP_TIMEOUT_MS) == sizeof(status)) {
+        skipped = status[6] | status[7] << 8;
+        noerase = status[8] | status[9] << 8;
+        memcpy(&dev_wire, status + 12, 4);
+        memcpy(&dev_image, status + 16, 4);
+    }
+
+    if (verify_crc && dfu_verify_crc(base, image, size) < 0) {
+        return EXIT_FAILURE;
+    }
+    if (read_back && dfu_read_back(base, image, size) < 0) {
+        return EXIT_FAILURE;
+    }
+    if (show_stats) {
+        print_stats();
+    }
+    if (show_profile) {
+        print_profile();
+    }
+
+    /* Leave DFU mode */
+    host_request((const uint8_t *)"\xf3\x07\x00\x00", NULL, 0);
+    if (sim_wait_reset(DFU_OP_TIMEOUT_MS) < 0) {
+        fprintf(stderr, "bootloader did not reset\n");
+    }
+    if (show_trace) {
+        trace_stop = 1;
+        pthread_join(trace_tid, NULL);
+    }
+
+    printf("image:      %zu bytes at 0x%08x, %u chunks\n", size, base, chunks);
+    printf("elapsed:    %.3f s, %.1f KB/s\n", elapsed / 1e6, size / 1024.0 / (elapsed / 1e6));
+    printf("per chunk:  min %.2f ms, avg %.2f ms, max %.2f ms\n",
+        lat_min / 1e3, lat_sum / 1e3 / chunks, lat_max / 1e3);
+    printf("pages:      %u skipped, %u programmed without erase\n", skipped, noerase);
+    printf("wire:       %u bytes, %.1f KB/s (device: %u received, %u programmed)\n", wire,
+        wire / 1024.0 / (elapsed / 1e6), dev_wire, dev_image);
+
+    for (off = 0; off < size; off++) {
+        if (((volatile uint8_t *)(uintptr_t)base)[off] != image[off]) {
+            break;
+        }
+    }
+    if (off != size) {
+        printf("flash:      %s, MISMATCH at 0x%08zx\n", sim_config.flash_path, base + off);
+        return EXIT_FAILURE;
+    }
+    printf("flash:      %s, contents match\n", sim_config.flash_path);
+
+    return EXIT_SUCCESS;
+}
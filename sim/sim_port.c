@@ -0,0 +1,1007 @@
+/*
+ * Copyright (C) 2017 https://www.brobwind.com
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "ch.h"
+#include "hal.h"
+#include "chprintf.h"
+
+#include "sim.h"
+
+
+sim_config_t sim_config = {
+    .flash_path     = "bdlink-flash.bin",
+    .blank          = 0,
+    .erase_us       = 20000,
+    .program_us     = 52,
+    .flash_overlap  = 0,
+    .usb_packet_us  = 0,
+    .usb_double_buffer = 0,
+    .clock_init_us  = 2200,
+    .power_on       = 0,
+};
+
+static uint64_t sim_boot_us;
+
+uint64_t sim_now_us(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void sim_sleep_us(uint64_t usec) {
+    struct timespec ts = {
+        .tv_sec  = usec / 1000000,
+        .tv_nsec = (usec % 1000000) * 1000,
+    };
+
+    while (nanosleep(&ts, &ts) != 0 && errno == EINTR) {}
+}
+
+static void sim_deadline(struct timespec *ts, uint64_t usec) {
+    clock_gettime(CLOCK_REALTIME, ts);
+    ts->tv_sec  += usec / 1000000;
+    ts->tv_nsec += (usec % 1000000) * 1000;
+    if (ts->tv_nsec >= 1000000000) {
+        ts->tv_sec  += 1;
+        ts->tv_nsec -= 1000000000;
+    }
+}
+
+/*===========================================================================*/
+/* Kernel                                                                    */
+/*===========================================================================*/
+
+/* Held by whichever simulated thread is currently "running" */
+static pthread_mutex_t sim_kernel = PTHREAD_MUTEX_INITIALIZER;
+
+static void sim_block_begin(void) {
+    pthread_mutex_unlock(&sim_kernel);
+}
+
+static void sim_block_end(void) {
+    pthread_mutex_lock(&sim_kernel);
+}
+
+static void *sim_thread_start(void *p) {
+    thread_t *tp = (thread_t *)p;
+
+    pthread_mutex_lock(&sim_kernel);
+    tp->pf(tp->arg);
+    pthread_mutex_unlock(&sim_kernel);
+
+    return NULL;
+}
+
+thread_t *chThdCreateStatic(void *wsp, size_t size, tprio_t prio, tfunc_t pf, void *arg) {
+    thread_t *tp = calloc(1, sizeof(*tp));
+
+    (void)wsp;
+    (void)size;
+    (void)prio;
+
+    tp->pf  = pf;
+    tp->arg = arg;
+    if (pthread_create(&tp->tid, NULL, sim_thread_start, tp) != 0) {
+        perror("pthread_create");
+        exit(EXIT_FAILURE);
+    }
+
+    return tp;
+}
+
+void chRegSetThreadName(const char *name) {
+    pthread_setname_np(pthread_self(), name);
+}
+
+void chThdSleepMicroseconds(uint32_t usec) {
+    sim_block_begin();
+    sim_sleep_us(usec);
+    sim_block_end();
+}
+
+void chThdSleepMilliseconds(uint32_t msec) {
+    chThdSleepMicroseconds(msec * 1000);
+}
+
+void chThdSleep(systime_t time) {
+    chThdSleepMicroseconds((uint64_t)time * 1000000 / CH_CFG_ST_FREQUENCY);
+}
+
+systime_t chVTGetSystemTime(void) {
+    return (systime_t)((sim_now_us() - sim_boot_us) * CH_CFG_ST_FREQUENCY / 1000000);
+}
+
+/* Never the same value twice: two reads of the cycle counter are some
+   cycles apart, RTC2US() of a zero interval wraps */
+rtcnt_t chSysGetRealtimeCounterX(void) {
+    static rtcnt_t last;
+    rtcnt_t prev = __atomic_load_n(&last, __ATOMIC_RELAXED), now;
+
+    do {
+        now = (rtcnt_t)((sim_now_us() - sim_boot_us) * (STM32_HCLK / 1000000));
+        if ((int32_t)(now - prev) <= 0) {
+            now = prev + 1;
+        }
+    } while (!__atomic_compare_exchange_n(&last, &prev, now, FALSE, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+
+    return now;
+}
+
+void chSysInit(void) {
+}
+
+void chSemObjectInit(semaphore_t *sp, cnt_t n) {
+    pthread_mutex_lock(&sp->mtx);
+    sp->cnt = n;
+    pthread_mutex_unlock(&sp->mtx);
+}
+
+msg_t chSemWaitTimeout(semaphore_t *sp, systime_t time) {
+    struct timespec ts;
+    msg_t msg = MSG_OK;
+
+    sim_block_begin();
+    pthread_mutex_lock(&sp->mtx);
+    if (time != TIME_INFINITE) {
+        sim_deadline(&ts, (uint64_t)time * 1000000 / CH_CFG_ST_FREQUENCY);
+    }
+    while (sp->cnt <= 0) {
+        if (time == TIME_INFINITE) {
+            pthread_cond_wait(&sp->cond, &sp->mtx);
+        } else if (pthread_cond_timedwait(&sp->cond, &sp->mtx, &ts) == ETIMEDOUT) {
+            msg = MSG_TIMEOUT;
+            break;
+        }
+    }
+    if (msg == MSG_OK) {
+        sp->cnt--;
+    }
+    pthread_mutex_unlock(&sp->mtx);
+    sim_block_end();
+
+    return msg;
+}
+
+msg_t chSemWait(semaphore_t *sp) {
+    return chSemWaitTimeout(sp, TIME_INFINITE);
+}
+
+void chSemSignal(semaphore_t *sp) {
+    pthread_mutex_lock(&sp->mtx);
+    sp->cnt++;
+    pthread_cond_signal(&sp->cond);
+    pthread_mutex_unlock(&sp->mtx);
+}
+
+/* Signalling a binary semaphore that is not taken does nothing */
+void chBSemSignal(binary_semaphore_t *bsp) {
+    semaphore_t *sp = &bsp->sem;
+
+    pthread_mutex_lock(&sp->mtx);
+    if (sp->cnt < 1) {
+        sp->cnt++;
+        pthread_cond_signal(&sp->cond);
+    }
+    pthread_mutex_unlock(&sp->mtx);
+}
+
+void chMtxObjectInit(mutex_t *mp) {
+    (void)mp;
+}
+
+void chMtxLock(mutex_t *mp) {
+    if (pthread_mutex_trylock(&mp->mtx) == 0) {
+        return;
+    }
+
+    sim_block_begin();
+    pthread_mutex_lock(&mp->mtx);
+    sim_block_end();
+}
+
+void chMtxUnlock(mutex_t *mp) {
+    pthread_mutex_unlock(&mp->mtx);
+}
+
+void chPoolObjectInit(memory_pool_t *mp, size_t size, memgetfunc_t provider) {
+    pthread_mutex_lock(&mp->mtx);
+    mp->next = NULL;
+    mp->object_size = size;
+    mp->provider = provider;
+    pthread_mutex_unlock(&mp->mtx);
+}
+
+void chPoolFree(memory_pool_t *mp, void *objp) {
+    struct pool_header *php = objp;
+
+    pthread_mutex_lock(&mp->mtx);
+    php->next = mp->next;
+    mp->next = php;
+    pthread_mutex_unlock(&mp->mtx);
+}
+
+void chPoolLoadArray(memory_pool_t *mp, void *p, size_t n) {
+    while (n-- != 0) {
+        chPoolFree(mp, p);
+        p = (uint8_t *)p + mp->object_size;
+    }
+}
+
+void *chPoolAlloc(memory_pool_t *mp) {
+    struct pool_header *php;
+
+    pthread_mutex_lock(&mp->mtx);
+    php = mp->next;
+    if (php != NULL) {
+        mp->next = php->next;
+    } else if (mp->provider != NULL) {
+        php = mp->provider(mp->object_size);
+    }
+    pthread_mutex_unlock(&mp->mtx);
+
+    return php;
+}
+
+void chMBObjectInit(mailbox_t *mbp, msg_t *buf, size_t n) {
+    pthread_mutex_lock(&mbp->mtx);
+    mbp->buffer = buf;
+    mbp->size = n;
+    mbp->rdidx = 0;
+    mbp->cnt = 0;
+    pthread_mutex_unlock(&mbp->mtx);
+}
+
+static msg_t sim_mb_wait(mailbox_t *mbp, bool (*ready)(mailbox_t *), systime_t timeout) {
+    struct timespec ts;
+
+    if (timeout != TIME_INFINITE) {
+        sim_deadline(&ts, (uint64_t)timeout * 1000000 / CH_CFG_ST_FREQUENCY);
+    }
+    while (!ready(mbp)) {
+        if (timeout == TIME_INFINITE) {
+            pthread_cond_wait(&mbp->cond, &mbp->mtx);
+        } else if (pthread_cond_timedwait(&mbp->cond, &mbp->mtx, &ts) == ETIMEDOUT) {
+            return MSG_TIMEOUT;
+        }
+    }
+
+    return MSG_OK;
+}
+
+static bool sim_mb_has_space(mailbox_t *mbp) {
+    return mbp->cnt < mbp->size;
+}
+
+static bool sim_mb_has_message(mailbox_t *mbp) {
+    return mbp->cnt > 0;
+}
+
+msg_t chMBPost(mailbox_t *mbp, msg_t msg, systime_t timeout) {
+    msg_t rdymsg;
+
+    sim_block_begin();
+    pthread_mutex_lock(&mbp->mtx);
+    rdymsg = sim_mb_wait(mbp, sim_mb_has_space, timeout);
+    if (rdymsg == MSG_OK) {
+        mbp->buffer[(mbp->rdidx + mbp->cnt) % mbp->size] = msg;
+        mbp->cnt++;
+        pthread_cond_broadcast(&mbp->cond);
+    }
+    pthread_mutex_unlock(&mbp->mtx);
+    sim_block_end();
+
+    return rdymsg;
+}
+
+msg_t chMBFetch(mailbox_t *mbp, msg_t *msgp, systime_t timeout) {
+    msg_t rdymsg;
+
+    sim_block_begin();
+    pthread_mutex_lock(&mbp->mtx);
+    rdymsg = sim_mb_wait(mbp, sim_mb_has_message, timeout);
+    if (rdymsg == MSG_OK) {
+        *msgp = mbp->buffer[mbp->rdidx];
+        mbp->rdidx = (mbp->rdidx + 1) % mbp->size;
+        mbp->cnt--;
+        pthread_cond_broadcast(&mbp->cond);
+    }
+    pthread_mutex_unlock(&mbp->mtx);
+    sim_block_end();
+
+    return rdymsg;
+}
+
+/*===========================================================================*/
+/* System                                                                    */
+/*===========================================================================*/
+
+/* A software reset keeps the bootloader from jumping to the application */
+RCC_TypeDef sim_rcc = {
+    .CR  = RCC_CR_HSION | RCC_CR_HSIRDY,
+    .CSR = RCC_CSR_SFTRSTF,
+};
+
+BKP_TypeDef sim_bkp;
+PWR_TypeDef sim_pwr;
+
+/* PC13 pulled down, PC14 floating: an ST-LINK/V2-1 board */
+GPIO_TypeDef sim_gpioa, sim_gpioc = {
+    .IDR = 1 << 14,
+};
+
+SerialDriver SD2 = {
+    .stream = { .fd = STDERR_FILENO },
+};
+
+static pthread_mutex_t sim_reset_mtx = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t sim_reset_cond = PTHREAD_COND_INITIALIZER;
+static int sim_reset_count;
+
+void NVIC_SystemReset(void) {
+    pthread_mutex_lock(&sim_reset_mtx);
+    sim_reset_count++;
+    pthread_cond_broadcast(&sim_reset_cond);
+    pthread_mutex_unlock(&sim_reset_mtx);
+
+    /* The simulated core is gone, leave the rest to the host */
+    sim_block_begin();
+    while (true) {
+        pause();
+    }
+}
+
+int sim_wait_reset(uint32_t timeout_ms) {
+    struct timespec ts;
+    int ret = 0;
+
+    sim_deadline(&ts, (uint64_t)timeout_ms * 1000);
+    pthread_mutex_lock(&sim_reset_mtx);
+    while (sim_reset_count == 0 && ret == 0) {
+        ret = pthread_cond_timedwait(&sim_reset_cond, &sim_reset_mtx, &ts);
+    }
+    pthread_mutex_unlock(&sim_reset_mtx);
+
+    return sim_reset_count != 0 ? 0 : -1;
+}
+
+/* HSE start-up (2 ms typical with the 8 MHz crystal) and PLL lock */
+void stm32_clock_init(void) {
+    sim_sleep_us(sim_config.clock_init_us);
+}
+
+void halInit(void) {
+}
+
+static uint64_t sim_reset_us;
+static uint64_t sim_app_us;
+
+void sim_app_entry(void) {
+    pthread_mutex_lock(&sim_reset_mtx);
+    sim_app_us = sim_now_us();
+    pthread_cond_broadcast(&sim_reset_cond);
+    pthread_mutex_unlock(&sim_reset_mtx);
+
+    sim_block_begin();
+    pthread_exit(NULL);
+}
+
+int sim_wait_app(uint32_t timeout_ms, uint64_t *us) {
+    struct timespec ts;
+    int ret = 0;
+
+    sim_deadline(&ts, (uint64_t)timeout_ms * 1000);
+    pthread_mutex_lock(&sim_reset_mtx);
+    while (sim_app_us == 0 && ret == 0) {
+        ret = pthread_cond_timedwait(&sim_reset_cond, &sim_reset_mtx, &ts);
+    }
+    *us = sim_app_us - sim_reset_us;
+    pthread_mutex_unlock(&sim_reset_mtx);
+
+    return sim_app_us != 0 ? 0 : -1;
+}
+
+void sdStart(SerialDriver *sdp, const void *config) {
+    (void)sdp;
+    (void)config;
+}
+
+int chvprintf(BaseSequentialStream *chp, const char *fmt, va_list ap) {
+    return vdprintf(chp->fd, fmt, ap);
+}
+
+int chprintf(BaseSequentialStream *chp, const char *fmt, ...) {
+    va_list ap;
+    int n;
+
+    va_start(ap, fmt);
+    n = chvprintf(chp, fmt, ap);
+    va_end(ap);
+
+    return n;
+}
+
+/*===========================================================================*/
+/* On-chip flash                                                             */
+/*===========================================================================*/
+
+/* Set on every value handed out through FLASH->SR, a write from the
+   bootloader (write 1 to clear) never sets it */
+#define SIM_SR_UNTOUCHED                (1U << 31)
+
+static struct {
+    FLASH_TypeDef regs;
+    uint32_t sr;
+    bool locked;
+    int keystage;
+    uint64_t busy_until;
+    bool erase_pending;
+    uint32_t erase_addr;
+    volatile bool write_pending;
+    uintptr_t write_addr;
+    uint16_t write_old;
+} sim_fpec = {
+    .regs   = { .CR = FLASH_CR_LOCK, },
+    .locked = true,
+};
+
+static long sim_page_size;
+
+static void sim_flash_protect(uintptr_t addr, int prot) {
+    mprotect((void *)(addr & ~(uintptr_t)(sim_page_size - 1)), sim_page_size, prot);
+}
+
+/* The part has a single flash bank and fetches from it stall while BSY is set:
+   the calling thread holds the kernel, so waiting here stops every simulated
+   thread until the operation is over. It spins, a nanosleep() would oversleep
+   each 52 us half-word program by its timer slack. With -O the others get the
+   kernel while the caller polls BSY, as they would if all the code were in SRAM */
+static void sim_flash_stall(void) {
+    if ((sim_fpec.sr & FLASH_SR_BSY) == 0) {
+        return;
+    }
+    if (!sim_config.flash_overlap) {
+        while (sim_now_us() < sim_fpec.busy_until) {}
+    } else {
+        sim_block_begin();
+        sched_yield();
+        sim_block_end();
+    }
+}
+
+static void sim_flash_erase(uint32_t addr) {
+    addr &= ~(uint32_t)(SIM_FLASH_PAGE_SIZE - 1);
+    if (addr < FLASH_BASE || addr >= FLASH_BASE + SIM_FLASH_SIZE) {
+        return;
+    }
+
+    sim_flash_protect(addr, PROT_READ | PROT_WRITE);
+    memset((void *)(uintptr_t)addr, 0xff, SIM_FLASH_PAGE_SIZE);
+    sim_flash_protect(addr, PROT_READ);
+}
+
+/*===========================================================================*/
+/* CRC unit and DMA1                                                         */
+/*===========================================================================*/
+
+static struct {
+    uint32_t value;
+    volatile bool write_pending;
+    uintptr_t write_off;
+} sim_crc = {
+    .value = 0xffffffff,
+};
+
+static uint32_t sim_crc_word(uint32_t crc, uint32_t word) {
+    int bit;
+
+    crc ^= word;
+    for (bit = 0; bit < 32; bit++) {
+        crc = crc & 0x80000000 ? (crc << 1) ^ 0x04c11db7 : crc << 1;
+    }
+
+    return crc;
+}
+
+/* Hands the CRC out through DR, the page goes back to read-only */
+static void sim_crc_publish(void) {
+    CRC_TypeDef *r = (CRC_TypeDef *)(uintptr_t)CRC_BASE;
+
+    mprotect(r, sim_page_size, PROT_READ | PROT_WRITE);
+    r->DR = sim_crc.value;
+    r->CR = 0;
+    mprotect(r, sim_page_size, PROT_READ);
+    sim_crc.write_pending = false;
+}
+
+CRC_TypeDef *sim_crc_regs(void) {
+    CRC_TypeDef *r = (CRC_TypeDef *)(uintptr_t)CRC_BASE;
+
+    if (sim_crc.write_pending) {
+        if (sim_crc.write_off == offsetof(CRC_TypeDef, DR)) {
+            sim_crc.value = sim_crc_word(sim_crc.value, r->DR);
+        } else if (sim_crc.write_off == offsetof(CRC_TypeDef, CR) && (r->CR & CRC_CR_RESET)) {
+            sim_crc.value = 0xffffffff;
+        }
+        sim_crc_publish();
+    }
+
+    return r;
+}
+
+static DMA_Channel_TypeDef sim_dma1_ch1;
+static bool sim_dma1_ch1_allocated;
+
+const stm32_dma_stream_t sim_dma1_stream1 = {
+    .channel    = &sim_dma1_ch1,
+    .selfindex  = 0,
+};
+
+bool dmaStreamAllocate(const stm32_dma_stream_t *dmastp, uint32_t priority, stm32_dmaisr_t func, void *param) {
+    (void)priority;
+    (void)func;
+    (void)param;
+
+    if (sim_dma1_ch1_allocated) {
+        return true;
+    }
+    sim_dma1_ch1_allocated = true;
+    sim_rcc.AHBENR |= RCC_AHBENR_DMA1EN;
+    dmastp->channel->CCR = 0;
+
+    return false;
+}
+
+void dmaStreamRelease(const stm32_dma_stream_t *dmastp) {
+    (void)dmastp;
+
+    sim_dma1_ch1_allocated = false;
+    sim_rcc.AHBENR &= ~RCC_AHBENR_DMA1EN;
+}
+
+void dmaStreamClearInterrupt(const stm32_dma_stream_t *dmastp) {
+    (void)dmastp;
+}
+
+void dmaStreamEnable(const stm32_dma_stream_t *dmastp) {
+    DMA_Channel_TypeDef *ch = dmastp->channel;
+    const uint32_t mode = STM32_DMA_CR_DIR_M2M | STM32_DMA_CR_PINC |
+                          STM32_DMA_CR_PSIZE_WORD | STM32_DMA_CR_MSIZE_WORD;
+    uint32_t idx;
+
+    /* Anything else is not modelled, it would hang dmaWaitCompletion() */
+    if (!sim_dma1_ch1_allocated || (ch->CCR & ~(STM32_DMA_CR_TCIE | STM32_DMA_CR_TEIE)) != mode ||
+            ch->CMAR != CRC_BASE + offsetof(CRC_TypeDef, DR)) {
+        fprintf(stderr, "sim: unsupported DMA1 channel 1 transfer, CCR 0x%08x\n", ch->CCR);
+        abort();
+    }
+
+    ch->CCR |= STM32_DMA_CR_EN;
+    sim_crc_regs();
+    for (idx = 0; idx < ch->CNDTR; idx++) {
+        sim_crc.value = sim_crc_word(sim_crc.value, *(volatile uint32_t *)(uintptr_t)(ch->CPAR + idx * 4));
+    }
+    sim_crc_publish();
+    ch->CNDTR = 0;
+}
+
+/*
+ * Flash is mapped read-only: a half-word store from the bootloader faults,
+ * we record the old value and let the store through. The FPEC model picks
+ * it up on the next register access and applies the programming rules and
+ * timing to it.
+ */
+static void sim_flash_fault(int sig, siginfo_t *si, void *ctx) {
+    static const char msg[] = "sim: invalid memory access\n";
+    uintptr_t addr = (uintptr_t)si->si_addr;
+
+    (void)ctx;
+
+    if (addr >= FLASH_BASE && addr < FLASH_BASE + SIM_FLASH_SIZE &&
+            (sim_fpec.regs.CR & FLASH_CR_PG) && !sim_fpec.locked && !sim_fpec.write_pending) {
+        sim_fpec.write_addr     = addr & ~(uintptr_t)1;
+        sim_fpec.write_old      = *(volatile uint16_t *)sim_fpec.write_addr;
+        sim_fpec.write_pending  = true;
+        sim_flash_protect(addr, PROT_READ | PROT_WRITE);
+        return;
+    }
+
+    if (addr >= CRC_BASE && addr < CRC_BASE + sizeof(CRC_TypeDef) && !sim_crc.write_pending) {
+        sim_crc.write_off       = addr - CRC_BASE;
+        sim_crc.write_pending   = true;
+        mprotect((void *)(uintptr_t)CRC_BASE, sim_page_size, PROT_READ | PROT_WRITE);
+        return;
+    }
+
+    /* Not ours: let the faulting instruction crash for real */
+    if (write(STDERR_FILENO, msg, sizeof(msg) - 1) < 0) {}
+    signal(sig, SIG_DFL);
+}
+
+FLASH_TypeDef *sim_flash_regs(void) {
+    FLASH_TypeDef *r = &sim_fpec.regs;
+    uint64_t now = sim_now_us();
+
+    /* 1. Unlock sequence */
+    if (r->KEYR != 0) {
+        if (r->KEYR == FLASH_KEY1) {
+            sim_fpec.keystage = 1;
+        } else if (r->KEYR == FLASH_KEY2 && sim_fpec.keystage == 1) {
+            sim_fpec.locked = false;
+            sim_fpec.keystage = 0;
+            r->CR = 0;
+        } else {
+            sim_fpec.keystage = 0;
+        }
+        r->KEYR = 0;
+    }
+    if (sim_fpec.locked || (r->CR & FLASH_CR_LOCK)) {
+        sim_fpec.locked = true;
+        r->CR = FLASH_CR_LOCK;
+    }
+
+    /* 2. Status flags are cleared by writing 1 */
+    if ((r->SR & SIM_SR_UNTOUCHED) == 0) {
+        sim_fpec.sr &= ~(r->SR & (FLASH_SR_PGERR | FLASH_SR_WRPRTERR | FLASH_SR_EOP));
+    }
+
+    /* 3. Pending operation is done */
+    if ((sim_fpec.sr & FLASH_SR_BSY) && now >= sim_fpec.busy_until) {
+        if (sim_fpec.erase_pending) {
+            sim_flash_erase(sim_fpec.erase_addr);
+            sim_fpec.erase_pending = false;
+            r->CR &= ~FLASH_CR_STRT;
+        }
+        sim_fpec.sr = (sim_fpec.sr & ~FLASH_SR_BSY) | FLASH_SR_EOP;
+    }
+
+    /* 4. A half-word was written to the flash */
+    if ((sim_fpec.sr & FLASH_SR_BSY) == 0 && sim_fpec.write_pending) {
+        volatile uint16_t *p = (volatile uint16_t *)sim_fpec.write_addr;
+
+        if (sim_fpec.write_old != 0xffff && *p != 0x0000) {
+            *p = sim_fpec.write_old;
+            sim_fpec.sr |= FLASH_SR_PGERR;
+        } else {
+            sim_fpec.sr |= FLASH_SR_BSY;
+            sim_fpec.busy_until = now + sim_config.program_us;
+        }
+        sim_flash_protect(sim_fpec.write_addr, PROT_READ);
+        sim_fpec.write_pending = false;
+    }
+
+    /* 5. Page erase was started */
+    if ((sim_fpec.sr & FLASH_SR_BSY) == 0 && (r->CR & FLASH_CR_STRT)) {
+        if (r->CR & FLASH_CR_PER) {
+            sim_fpec.erase_addr     = r->AR;
+            sim_fpec.erase_pending  = true;
+            sim_fpec.sr            |= FLASH_SR_BSY;
+            sim_fpec.busy_until     = now + sim_config.erase_us;
+        } else {
+            r->CR &= ~FLASH_CR_STRT;
+        }
+    }
+
+    r->SR = sim_fpec.sr | SIM_SR_UNTOUCHED;
+    sim_flash_stall();
+
+    return r;
+}
+
+static int sim_map(uintptr_t addr, size_t size, int prot, int flags, int fd, off_t offset) {
+    void *p = mmap((void *)addr, size, prot, flags | MAP_FIXED_NOREPLACE, fd, offset);
+
+    if (p == MAP_FAILED || (uintptr_t)p != addr) {
+        fprintf(stderr, "sim: cannot map 0x%08lx: %s\n", (unsigned long)addr, strerror(errno));
+        return -1;
+    }
+
+    return 0;
+}
+
+int sim_init(void) {
+    struct sigaction sa;
+    struct stat st;
+    uint8_t *sysmem;
+    int fd, i;
+
+    sim_boot_us = sim_now_us();
+    sim_page_size = sysconf(_SC_PAGESIZE);
+
+    /* 1. Flash backing file, created erased */
+    fd = open(sim_config.flash_path, O_RDWR | O_CREAT, 0644);
+    if (fd < 0 || fstat(fd, &st) < 0) {
+        perror(sim_config.flash_path);
+        return -1;
+    }
+    if (sim_config.blank || st.st_size != SIM_FLASH_SIZE) {
+        static uint8_t erased[SIM_FLASH_SIZE];
+
+        memset(erased, 0xff, sizeof(erased));
+        if (ftruncate(fd, 0) < 0 || pwrite(fd, erased, sizeof(erased), 0) != sizeof(erased)) {
+            perror(sim_config.flash_path);
+            return -1;
+        }
+    }
+
+    /* 2. Flash at its real address, plus the alias of its last page at
+          0x00000000 + size - page (boot from flash) where the bootloader
+          looks for the application magic value */
+    if (sim_map(FLASH_BASE, SIM_FLASH_SIZE, PROT_READ, MAP_SHARED, fd, 0) < 0 ||
+            sim_map(SIM_FLASH_SIZE - sim_page_size, sim_page_size, PROT_READ, MAP_SHARED,
+                fd, SIM_FLASH_SIZE - sim_page_size) < 0) {
+        return -1;
+    }
+    close(fd);
+
+    /* 3. CRC unit, see sim_crc_regs() */
+    if (sim_map(CRC_BASE, sim_page_size, PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0) < 0) {
+        return -1;
+    }
+    sim_crc_publish();
+
+    /* 4. System memory: flash size and unique device ID */
+    if (sim_map(SIM_SYSMEM_BASE, sim_page_size, PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0) < 0) {
+        return -1;
+    }
+    sysmem = (uint8_t *)SIM_SYSMEM_BASE;
+    *(uint16_t *)(sysmem + 0x7e0) = SIM_FLASH_SIZE / 1024;
+    for (i = 0; i < 12; i++) {
+        sysmem[0x7e8 + i] = 0x30 + i * 7;
+    }
+
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_sigaction = sim_flash_fault;
+    sa.sa_flags = SA_SIGINFO;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGSEGV, &sa, NULL);
+
+    return 0;
+}
+
+static int (*sim_entry)(void);
+
+static THD_FUNCTION(sim_main_thread, arg) {
+    (void)arg;
+
+    sim_entry();
+}
+
+void sim_boot(int (*entry)(void)) {
+    if (sim_config.power_on) {
+        sim_rcc.CSR = RCC_CSR_PORRSTF | RCC_CSR_PINRSTF;
+    }
+    sim_reset_us = sim_now_us();
+    sim_entry = entry;
+    chThdCreateStatic(NULL, 0, NORMALPRIO, sim_main_thread, NULL);
+}
+
+/*===========================================================================*/
+/* USB                                                                       */
+/*===========================================================================*/
+
+#define SIM_EP_BUFFER_SIZE              (16 * 1024)
+
+/*
+ * One transfer slot per IN endpoint, the transfer completes once the host
+ * picked it up. OUT endpoints hold one packet, or two with double
+ * buffering, and only take packets while the bootloader sits in
+ * usbReceive() (the endpoint NAKs otherwise).
+ */
+typedef struct {
+    pthread_mutex_t mtx;
+    pthread_cond_t cond;
+    bool armed;
+    bool full;
+    size_t len;
+    size_t pktlen[2];
+    unsigned head;
+    unsigned count;
+    uint8_t buf[SIM_EP_BUFFER_SIZE];
+} sim_ep_t;
+
+#define SIM_EP_INIT     { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, false, false, 0, {0, 0}, 0, 0, {0} }
+
+static sim_ep_t sim_ep[USB_MAX_ENDPOINTS + 1] = {
+    SIM_EP_INIT, SIM_EP_INIT, SIM_EP_INIT, SIM_EP_INIT,
+    SIM_EP_INIT, SIM_EP_INIT, SIM_EP_INIT, SIM_EP_INIT,
+};
+
+USBDriver USBD1;
+
+void usbStart(USBDriver *usbp, const USBConfig *config) {
+    usbp->config = config;
+    usbp->state = USB_READY;
+}
+
+void usbConnectBus(USBDriver *usbp) {
+    if (usbp->config == NULL) {
+        return;
+    }
+
+    /* Enumeration */
+    usbp->config->event_cb(usbp, USB_EVENT_RESET);
+    usbp->config->event_cb(usbp, USB_EVENT_ADDRESS);
+    usbp->state = USB_ACTIVE;
+    usbp->config->event_cb(usbp, USB_EVENT_CONFIGURED);
+}
+
+void usbDisconnectBus(USBDriver *usbp) {
+    if (usbp->state == USB_ACTIVE) {
+        usbp->state = USB_READY;
+    }
+}
+
+void usbInitEndpointI(USBDriver *usbp, usbep_t ep, const USBEndpointConfig *epcp) {
+    usbp->epc[ep] = epcp;
+}
+
+msg_t usbReceive(USBDriver *usbp, usbep_t ep, uint8_t *buf, size_t n) {
+    sim_ep_t *sep = &sim_ep[ep];
+    size_t received = 0;
+
+    if (usbp->state != USB_ACTIVE) {
+        return MSG_RESET;
+    }
+
+    sim_block_begin();
+    pthread_mutex_lock(&sep->mtx);
+    sep->armed = true;
+    pthread_cond_broadcast(&sep->cond);
+    while (true) {
+        size_t pktlen, len;
+
+        while (sep->count == 0) {
+            pthread_cond_wait(&sep->cond, &sep->mtx);
+        }
+        pktlen = sep->pktlen[sep->head];
+        len = pktlen < n - received ? pktlen : n - received;
+        memcpy(buf + received, sep->buf + sep->head * SIM_USB_PACKET_SIZE, len);
+        received += len;
+        sep->head = (sep->head + 1) % 2;
+        sep->count--;
+        pthread_cond_broadcast(&sep->cond);
+
+        if (pktlen < SIM_USB_PACKET_SIZE || received >= n) {
+            break;
+        }
+    }
+    sep->armed = false;
+    pthread_mutex_unlock(&sep->mtx);
+    sim_block_end();
+
+    return (msg_t)received;
+}
+
+/* Transfers larger than the slot go out a slot at a time, the host sees
+   the packets back to back */
+msg_t usbTransmit(USBDriver *usbp, usbep_t ep, const uint8_t *buf, size_t n) {
+    sim_ep_t *sep = &sim_ep[ep];
+
+    if (usbp->state != USB_ACTIVE) {
+        return MSG_RESET;
+    }
+
+    sim_block_begin();
+    pthread_mutex_lock(&sep->mtx);
+    do {
+        size_t len = n < SIM_EP_BUFFER_SIZE ? n : SIM_EP_BUFFER_SIZE;
+
+        while (sep->full) {
+            pthread_cond_wait(&sep->cond, &sep->mtx);
+        }
+        memcpy(sep->buf, buf, len);
+        sep->len = len;
+        sep->full = true;
+        pthread_cond_broadcast(&sep->cond);
+        while (sep->full) {
+            pthread_cond_wait(&sep->cond, &sep->mtx);
+        }
+
+        buf += len;
+        n   -= len;
+    } while (n > 0);
+    pthread_mutex_unlock(&sep->mtx);
+    sim_block_end();
+
+    return MSG_OK;
+}
+
+void sim_usb_wait_active(void) {
+    while (USBD1.state != USB_ACTIVE) {
+        sim_sleep_us(1000);
+    }
+}
+
+void sim_usb_host_write(uint8_t ep, const uint8_t *buf, size_t n) {
+    sim_ep_t *sep = &sim_ep[ep];
+    unsigned slots = sim_config.usb_double_buffer ? 2 : 1;
+
+    do {
+        size_t len = n < SIM_USB_PACKET_SIZE ? n : SIM_USB_PACKET_SIZE;
+        unsigned slot;
+
+        pthread_mutex_lock(&sep->mtx);
+        while (!sep->armed || sep->count >= slots) {
+            pthread_cond_wait(&sep->cond, &sep->mtx);
+        }
+        pthread_mutex_unlock(&sep->mtx);
+
+        /* The packet is on the bus */
+        if (sim_config.usb_packet_us != 0) {
+            sim_sleep_us(sim_config.usb_packet_us);
+        }
+
+        pthread_mutex_lock(&sep->mtx);
+        slot = (sep->head + sep->count) % 2;
+        memcpy(sep->buf + slot * SIM_USB_PACKET_SIZE, buf, len);
+        sep->pktlen[slot] = len;
+        sep->count++;
+        pthread_cond_broadcast(&sep->cond);
+        pthread_mutex_unlock(&sep->mtx);
+
+        buf += len;
+        n   -= len;
+    } while (n > 0);
+}
+
+int sim_usb_host_read(uint8_t ep, uint8_t *buf, size_t n, uint32_t timeout_ms) {
+    sim_ep_t *sep = &sim_ep[ep];
+    struct timespec ts;
+    size_t len;
+
+    sim_deadline(&ts, (uint64_t)timeout_ms * 1000);
+    pthread_mutex_lock(&sep->mtx);
+    while (!sep->full) {
+        if (pthread_cond_timedwait(&sep->cond, &sep->mtx, &ts) == ETIMEDOUT) {
+            pthread_mutex_unlock(&sep->mtx);
+            return -1;
+        }
+    }
+    len = sep->len < n ? sep->len : n;
+    memcpy(buf, sep->buf, len);
+    pthread_mutex_unlock(&sep->mtx);
+
+    if (sim_config.usb_packet_us != 0) {
+        sim_sleep_us(sim_config.usb_packet_us * ((len + SIM_USB_PACKET_SIZE - 1) / SIM_USB_PACKET_SIZE));
+    }
+
+    pthread_mutex_lock(&sep->mtx);
+    sep->full = false;
+    pthread_cond_broadcast(&sep->cond);
+    pthread_mutex_unlock(&sep->mtx);
+
+    return (int)len;
+}